@@ -0,0 +1,114 @@
+#define _GNU_SOURCE /* cpu_set_t, pthread_*affinity_np */
+#include "affinity.h"
+#include "segel.h"
+#include <sched.h>
+
+struct Affinity {
+    int count;
+    cpu_set_t *entries;
+};
+
+// helper function
+static void affinityAdd(Affinity a, cpu_set_t *set){
+    cpu_set_t *entries = (cpu_set_t *)realloc(a->entries, sizeof(cpu_set_t) * (a->count + 1));
+    if(entries == NULL){
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    a->entries = entries;
+    a->entries[a->count++] = *set;
+}
+
+// "<cpu>" or "<first>-<last>" into *first and *last, -1 if malformed or not on this machine
+// helper function
+static int affinityRange(const char *range, int *first, int *last){
+    char *end;
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    *first = *last = strtol(range, &end, 10);
+    if(end == range)
+        return -1;
+    if(*end == '-'){
+        range = end + 1;
+        *last = strtol(range, &end, 10);
+        if(end == range)
+            return -1;
+    }
+    if(*end != '\0' && *end != '\n')
+        return -1;
+    return (*first < 0 || *first > *last || *last >= cpus || *last >= CPU_SETSIZE) ? -1 : 0;
+}
+
+// the CPUs of NUMA node into set, from its cpulist ("0-3,8-11"), -1 if there is no such node
+// helper function
+static int affinityNode(const char *node, cpu_set_t *set){
+    char path[MAXLINE], cpulist[MAXLINE], *range, *rest;
+    int first, last;
+    char *end;
+    long id = strtol(node, &end, 10);
+    if(end == node || *end != '\0' || id < 0)
+        return -1;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", id);
+    FILE *file = fopen(path, "r");
+    if(file == NULL)
+        return -1;
+    char *line = fgets(cpulist, sizeof(cpulist), file);
+    fclose(file);
+    if(line == NULL)
+        return -1;
+    CPU_ZERO(set);
+    for(range = strtok_r(cpulist, ",", &rest); range; range = strtok_r(NULL, ",", &rest)){
+        if(affinityRange(range, &first, &last) < 0)
+            return -1;
+        for(int cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+    }
+    return CPU_COUNT(set) ? 0 : -1;   // a node with memory only
+}
+
+Affinity affinityParse(const char *list){
+    char copy[MAXLINE], *entry, *rest;
+    cpu_set_t set;
+    int first, last;
+    Affinity a = (Affinity)calloc(1, sizeof(*a));
+    if(a == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(copy, sizeof(copy), "%s", list);
+    for(entry = strtok_r(copy, ",", &rest); entry; entry = strtok_r(NULL, ",", &rest)){
+        if(strncmp(entry, "node", 4) == 0){
+            if(affinityNode(entry + 4, &set) < 0)
+                break;
+            affinityAdd(a, &set);
+            continue;
+        }
+        if(affinityRange(entry, &first, &last) < 0)
+            break;
+        for(int cpu = first; cpu <= last; cpu++){
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            affinityAdd(a, &set);
+        }
+    }
+    if(entry != NULL || a->count == 0){  // stopped at a bad entry
+        free(a->entries);
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+int affinityCreate(pthread_t *thread, Affinity a, int index, void *(*start)(void *), void *arg){
+    pthread_attr_t attr;
+    if(a == NULL)
+        return pthread_create(thread, NULL, start, arg);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &a->entries[index % a->count]);
+    int rc = pthread_create(thread, &attr, start, arg);
+    pthread_attr_destroy(&attr);
+    return rc;
+}
+
+int affinityApply(Affinity a, int index){
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &a->entries[index % a->count]);
+}
@@ -0,0 +1,31 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+
+//
+// affinity.c: the CPUs a kind of server thread runs on, from a list like "0-3,8,node1".
+//
+// Every entry of the list is a CPU, a range of CPUs ("0-3" is four entries, one
+// CPU each) or all the CPUs of a NUMA node ("node1" is one entry, read from
+// /sys). Thread i of the kind is pinned to entry i % count: "0-7" gives each
+// worker a CPU of its own, "node0,node1" alternates them over two nodes and lets
+// the scheduler move them only within their node.
+//
+// Threads are pinned from their first instruction on, so whatever they allocate
+// and touch themselves (their stack, stats, metrics) is placed by the kernel on
+// their own node.
+//
+
+typedef struct Affinity *Affinity;
+
+// NULL if the list is malformed or names a CPU or a node this machine does not have
+Affinity affinityParse(const char *list);
+
+// pthread_create, with the new thread pinned to entry index % count of a (not pinned if a is NULL)
+int affinityCreate(pthread_t *thread, Affinity a, int index, void *(*start)(void *), void *arg);
+
+// pin the calling thread to entry index % count, 0 on success
+int affinityApply(Affinity a, int index);
+
+#endif // AFFINITY_H
@@ -0,0 +1,255 @@
+#include "cache.h"
+#include "request.h"
+#include "segel.h"
+
+#define CACHE_BUCKETS 1024
+#define CACHE_MAX_SHARE 4   // a single file may take at most capacity / CACHE_MAX_SHARE
+
+struct Cache {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;  // an entry being loaded is ready, or failed
+    size_t capacity;
+    size_t used;
+    long ttl_ms;
+    cache_entry buckets[CACHE_BUCKETS];
+    cache_entry lru_head;   // most recently used
+    cache_entry lru_tail;   // next to be evicted
+};
+
+Cache cacheCreate(size_t capacity, int ttl_ms){
+    Cache c = (Cache)calloc(1, sizeof(*c));
+    if(c == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->loaded, NULL);
+    c->capacity = capacity;
+    c->ttl_ms = ttl_ms;
+    return c;
+}
+
+// helper function
+static unsigned cacheHash(const char *filename){
+    unsigned hash = 5381;
+    while(*filename)
+        hash = hash * 33 + (unsigned char)*filename++;
+    return hash % CACHE_BUCKETS;
+}
+
+// helper function
+static long elapsedMs(struct timespec from, struct timespec to){
+    return (to.tv_sec - from.tv_sec) * 1000 + (to.tv_nsec - from.tv_nsec) / 1000000;
+}
+
+// the caller holds c->lock
+// helper function
+static cache_entry cacheFind(Cache c, const char *filename){
+    cache_entry e = c->buckets[cacheHash(filename)];
+    while(e && strcmp(e->filename, filename) != 0)
+        e = e->hash_next;
+    return e;
+}
+
+// helper function
+static void lruUnlink(Cache c, cache_entry e){
+    if(e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else c->lru_head = e->lru_next;
+    if(e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else c->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+// helper function
+static void lruPushFront(Cache c, cache_entry e){
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    if(c->lru_head) c->lru_head->lru_prev = e;
+    c->lru_head = e;
+    if(c->lru_tail == NULL) c->lru_tail = e;
+}
+
+// helper function
+static void cacheFree(cache_entry e){
+    free(e->body);
+    free(e->header);
+    free(e->filename);
+    free(e);
+}
+
+// take an entry out of the cache, it is freed once the last user releases it
+// the caller holds c->lock
+// helper function
+static void cacheRemove(Cache c, cache_entry e){
+    if(e->evicted)
+        return;
+    cache_entry *link = &c->buckets[cacheHash(e->filename)];
+    while(*link != e)
+        link = &(*link)->hash_next;
+    *link = e->hash_next;
+    if(!e->loading){ // a loading entry is not in the LRU and takes no room yet
+        lruUnlink(c, e);
+        c->used -= e->size;
+    }
+    e->evicted = 1;
+    if(e->refcount == 0)
+        cacheFree(e);
+}
+
+// read a whole file into a new entry, NULL if it cannot be cached
+// helper function
+static cache_entry cacheLoad(Cache c, const char *filename, struct timespec now){
+    struct stat sbuf;
+    char filetype[MAXLINE], header[MAXLINE];
+    int srcfd = open(filename, O_RDONLY, 0);
+    if(srcfd < 0)
+        return NULL;
+    if(fstat(srcfd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) || !(S_IRUSR & sbuf.st_mode)
+       || (size_t)sbuf.st_size > c->capacity / CACHE_MAX_SHARE){
+        close(srcfd);
+        return NULL;
+    }
+
+    cache_entry e = (cache_entry)calloc(1, sizeof(*e));
+    if(e == NULL || (e->body = (char *)malloc(sbuf.st_size ? sbuf.st_size : 1)) == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    if(rio_readn(srcfd, e->body, sbuf.st_size) != sbuf.st_size){ // changed while we read it
+        close(srcfd);
+        free(e->body);
+        free(e);
+        return NULL;
+    }
+    close(srcfd);
+
+    e->size = sbuf.st_size;
+    e->ino = sbuf.st_ino;
+    e->mtime = sbuf.st_mtim;
+    e->checked = now;
+    e->filename = strdup(filename);
+    requestGetFiletype((char *)filename, filetype);
+    e->header_len = snprintf(header, sizeof(header),
+                             "HTTP/1.0 200 OK\r\n"
+                             "Server: OS-HW3 Web Server\r\n"
+                             "Content-Length: %zu\r\n"
+                             "Content-Type: %s\r\n", e->size, filetype);
+    e->header = strdup(header);
+    return e;
+}
+
+// wait until the worker loading e is done, NULL if it could not load it
+// the caller holds c->lock and a reference to e, which it no longer has on NULL
+// helper function
+static cache_entry cacheAwait(Cache c, cache_entry e){
+    while(e->loading)
+        pthread_cond_wait(&c->loaded, &c->lock);
+    if(e->body)
+        return e;
+    if(--e->refcount == 0 && e->evicted)
+        cacheFree(e);
+    return NULL;
+}
+
+// helper function
+static int cacheUnchanged(cache_entry e, struct stat *sbuf){
+    return S_ISREG(sbuf->st_mode) && (S_IRUSR & sbuf->st_mode)
+           && (size_t)sbuf->st_size == e->size && sbuf->st_ino == e->ino
+           && sbuf->st_mtim.tv_sec == e->mtime.tv_sec && sbuf->st_mtim.tv_nsec == e->mtime.tv_nsec;
+}
+
+cache_entry cacheGet(Cache c, const char *filename){
+    struct timespec now;
+    struct stat sbuf;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&c->lock);
+    cache_entry e = cacheFind(c, filename);
+    if(e){
+        e->refcount++;
+        if((e = cacheAwait(c, e)) == NULL || e->evicted){ // evicted meanwhile: its bytes are still good
+            pthread_mutex_unlock(&c->lock);
+            return e;
+        }
+        lruUnlink(c, e);
+        lruPushFront(c, e);
+        if(elapsedMs(e->checked, now) < c->ttl_ms){ // fresh: no syscall at all
+            pthread_mutex_unlock(&c->lock);
+            return e;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    // revalidate or load outside the lock, the file system may be slow
+    if(e){
+        if(stat(filename, &sbuf) == 0 && cacheUnchanged(e, &sbuf)){
+            pthread_mutex_lock(&c->lock);
+            e->checked = now;
+            pthread_mutex_unlock(&c->lock);
+            return e;
+        }
+        pthread_mutex_lock(&c->lock);
+        cacheRemove(c, e);
+        pthread_mutex_unlock(&c->lock);
+        cacheRelease(c, e);
+    }
+
+    // single flight: the entry goes in before the file is read, so the workers
+    // that miss on it meanwhile wait for this load instead of reading it too
+    pthread_mutex_lock(&c->lock);
+    if((e = cacheFind(c, filename)) != NULL){ // another worker is loading it, or has
+        e->refcount++;
+        e = cacheAwait(c, e);
+        pthread_mutex_unlock(&c->lock);
+        return e;
+    }
+    if((e = (cache_entry)calloc(1, sizeof(*e))) == NULL || (e->filename = strdup(filename)) == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    unsigned bucket = cacheHash(filename);
+    e->hash_next = c->buckets[bucket];
+    c->buckets[bucket] = e;
+    e->refcount = 1;
+    e->loading = 1;   // kept out of the LRU until it has a size
+    pthread_mutex_unlock(&c->lock);
+
+    cache_entry loaded = cacheLoad(c, filename, now);
+
+    pthread_mutex_lock(&c->lock);
+    if(loaded == NULL){
+        cacheRemove(c, e);
+        e->loading = 0;
+        pthread_cond_broadcast(&c->loaded);
+        pthread_mutex_unlock(&c->lock);
+        cacheRelease(c, e);
+        return NULL;
+    }
+    e->body = loaded->body;
+    e->size = loaded->size;
+    e->header = loaded->header;
+    e->header_len = loaded->header_len;
+    e->ino = loaded->ino;
+    e->mtime = loaded->mtime;
+    e->checked = loaded->checked;
+    e->loading = 0;
+    pthread_cond_broadcast(&c->loaded);
+    if(!e->evicted){
+        while(c->used + e->size > c->capacity && c->lru_tail)
+            cacheRemove(c, c->lru_tail);
+        lruPushFront(c, e);
+        c->used += e->size;
+    }
+    pthread_mutex_unlock(&c->lock);
+    free(loaded->filename);
+    free(loaded);
+    return e;
+}
+
+void cacheRelease(Cache c, cache_entry e){
+    pthread_mutex_lock(&c->lock);
+    e->refcount--;
+    if(e->evicted && e->refcount == 0)
+        cacheFree(e);
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,47 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+//
+// cache.c: in-memory cache of static files, shared by all worker threads.
+//
+// Entries hold the whole file plus the part of the response header that does
+// not change between requests. An entry is trusted for ttl_ms after it was last
+// checked; after that the next lookup stats the file again and reloads it
+// if its size or mtime changed. The cache holds at most capacity bytes of file
+// content and evicts the least recently used entries to stay under it.
+//
+// A file is read by one worker at a time: the workers that ask for it while
+// it loads wait for that load and share the entry (single flight).
+//
+
+typedef struct Cache *Cache;
+
+typedef struct Cache_entry{
+	char *body;           // the file content
+	size_t size;
+	char *header;         // "HTTP/1.0 200 OK ... Content-Type: ...\r\n", without the Stat-* lines
+	size_t header_len;
+
+	// managed by cache.c
+	char *filename;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec checked;
+	int refcount;
+	int evicted;
+	int loading;          // being read by the worker that missed first, the others wait for it
+	struct Cache_entry *hash_next, *lru_prev, *lru_next;
+} * cache_entry;
+
+Cache cacheCreate(size_t capacity, int ttl_ms);
+
+// return the entry for filename, loading it if needed, or NULL if it is not a
+// cacheable file (missing, not regular, not readable, too big). The caller must cacheRelease it
+cache_entry cacheGet(Cache c, const char *filename);
+
+void cacheRelease(Cache c, cache_entry entry);
+
+#endif // CACHE_H
@@ -0,0 +1,147 @@
+#include "cgipool.h"
+#include "segel.h"
+#include <poll.h>
+
+// one pre-spawned process of a program. sock is our end of its stdin
+struct CgiProc {
+    pid_t pid;              // 0 until started, and again after it died
+    int sock;
+    int busy;
+};
+
+struct CgiProgram {
+    char *filename;
+    int poolable;           // cleared once the program did not start in loop mode
+    struct CgiProc *procs;
+    struct CgiProgram *next;
+};
+
+struct CgiPool {
+    pthread_mutex_t lock;
+    int size;
+    struct CgiProgram *programs;
+};
+
+CgiPool cgiPoolCreate(int size){
+    CgiPool pool = (CgiPool)malloc(sizeof(*pool));
+    if(pool == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->size = size;
+    pool->programs = NULL;
+    return pool;
+}
+
+// the caller holds pool->lock
+// helper function
+static struct CgiProgram *cgiProgramFind(CgiPool pool, const char *filename){
+    struct CgiProgram *prog = pool->programs;
+    while(prog && strcmp(prog->filename, filename) != 0)
+        prog = prog->next;
+    if(prog)
+        return prog;
+
+    prog = (struct CgiProgram *)malloc(sizeof(*prog));
+    if(prog == NULL || (prog->procs = (struct CgiProc *)calloc(pool->size, sizeof(struct CgiProc))) == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    prog->filename = strdup(filename);
+    prog->poolable = 1;
+    prog->next = pool->programs;
+    pool->programs = prog;
+    return prog;
+}
+
+// an idle process, a running one if there is any. the caller holds pool->lock
+// helper function
+static struct CgiProc *cgiProcFree(CgiPool pool, struct CgiProgram *prog){
+    struct CgiProc *unstarted = NULL;
+    for(int i = 0; i < pool->size; i++){
+        struct CgiProc *proc = &prog->procs[i];
+        if(proc->busy)
+            continue;
+        if(proc->pid != 0)
+            return proc;
+        if(unstarted == NULL)
+            unstarted = proc;
+    }
+    return unstarted;
+}
+
+// helper function
+static void cgiProcKill(struct CgiProc *proc){
+    kill(proc->pid, SIGKILL);
+    waitpid(proc->pid, NULL, 0);
+    close(proc->sock);
+    proc->pid = 0;
+}
+
+// start filename in loop mode and wait until it reports ready, -1 if it does not
+// helper function
+static int cgiProcSpawn(struct CgiProc *proc, const char *filename){
+    int sv[2];
+    char ready, *emptylist[] = {NULL};
+    struct pollfd channel;
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0){
+        perror("socketpair");
+        return -1;
+    }
+    if((proc->pid = Fork()) == 0){
+        /* Child process */
+        Dup2(sv[1], STDIN_FILENO);
+        Dup2(Open("/dev/null", O_WRONLY, 0), STDOUT_FILENO); // output goes to the socket it is given per request
+        closefrom(STDERR_FILENO + 1); // must not keep other clients' sockets open
+        Setenv("CGI_LOOP", "1", 1);
+        signal(SIGPIPE, SIG_DFL); // the server ignores it, the program gets the usual default
+        Execve(filename, emptylist, environ);
+    }
+    close(sv[1]);
+    proc->sock = sv[0];
+
+    channel.fd = proc->sock;
+    channel.events = POLLIN;
+    if(poll(&channel, 1, CGI_READY_MS) != 1 || read(proc->sock, &ready, 1) != 1){
+        cgiProcKill(proc);
+        return -1;
+    }
+    return 0;
+}
+
+int cgiPoolServe(CgiPool pool, const char *filename, const char *cgiargs, int fd){
+    struct CgiProc *proc = NULL;
+    char done;
+    int served = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    struct CgiProgram *prog = cgiProgramFind(pool, filename);
+    if(!prog->poolable || (proc = cgiProcFree(pool, prog)) == NULL){ // all busy: fork one as before
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    proc->busy = 1;
+    pthread_mutex_unlock(&pool->lock);
+
+    // spawn and talk to the process outside the lock, other programs may be served meanwhile
+    int started = proc->pid != 0 || cgiProcSpawn(proc, filename) == 0;
+    if(started){
+        if(send_fd(proc->sock, fd, (void *)cgiargs, strlen(cgiargs) + 1) < 0){
+            cgiProcKill(proc); // died while idle, the request is still untouched
+        }
+        else{
+            served = 0;
+            if(read(proc->sock, &done, 1) != 1)
+                cgiProcKill(proc); // died during the request, a new one starts next time
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    proc->busy = 0;
+    if(!started)
+        prog->poolable = 0;
+    pthread_mutex_unlock(&pool->lock);
+    return served;
+}
@@ -0,0 +1,26 @@
+#ifndef CGIPOOL_H
+#define CGIPOOL_H
+
+//
+// cgipool.c: long lived CGI processes, so a dynamic request does not fork and exec.
+//
+// A program opts in to the pool by running in loop mode when CGI_LOOP is set in
+// its environment: it reports ready with one byte on stdin (a Unix socket), then
+// for every request receives the query string with the client socket attached,
+// writes its output to that socket and answers with one byte when done.
+// Programs that do not report ready within CGI_READY_MS are run the old way.
+//
+
+#define CGI_READY_MS 1000
+
+typedef struct CgiPool *CgiPool;
+
+// up to size processes per CGI program, started on their first request
+CgiPool cgiPoolCreate(int size);
+
+// run filename with cgiargs in an idle pooled process, writing its output to fd.
+// returns 0 once it is done, -1 if the program cannot be pooled or all its
+// processes are busy; nothing was sent to fd then
+int cgiPoolServe(CgiPool pool, const char *filename, const char *cgiargs, int fd);
+
+#endif // CGIPOOL_H
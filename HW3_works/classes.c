@@ -0,0 +1,140 @@
+#include "classes.h"
+#include "queue.h"
+#include "segel.h"
+
+#define CLASSES_STRIDE 1048576L   // pass advance of a weight 1 class per dispatch
+
+struct Class {
+    Queue requests;
+    int weight;
+    long pass;               // wfq: virtual time of the class' next dispatch, the smallest goes first
+};
+
+struct Classes {
+    int count;
+    int dispatch;
+    long aging_us;
+    long vtime;              // wfq: pass of the last dispatch
+    struct Class classes[CLASSES_MAX];
+};
+
+Classes classesCreate(int count, const int *weights, int size, int dispatch, int aging_ms){
+    Classes c = (Classes)calloc(1, sizeof(*c));
+    if(c == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    c->count = count;
+    c->dispatch = dispatch;
+    c->aging_us = aging_ms * 1000L;
+    for(int i = 0; i < count; i++){
+        c->classes[i].requests = queueCreate(size);
+        c->classes[i].weight = weights[i];
+    }
+    return c;
+}
+
+int classesCount(Classes c){
+    return c->count;
+}
+
+int classesWaiting(Classes c){
+    int waiting = 0;
+    for(int i = 0; i < c->count; i++)
+        waiting += queueSize(c->classes[i].requests);
+    return waiting;
+}
+
+int classesWaitingIn(Classes c, int cls){
+    return queueSize(c->classes[cls].requests);
+}
+
+void classesPush(Classes c, int cls, int descriptor, struct timeval arrival){
+    struct Class *class = &c->classes[cls];
+    if(c->dispatch == CLASSES_WFQ && queueEmpty(class->requests) && class->pass < c->vtime)
+        class->pass = c->vtime;  // no credit saved up while it had nothing to do
+    enqueue(class->requests, descriptor, arrival);
+}
+
+// helper function
+static int classesChooseWfq(Classes c){
+    int best = -1;
+    for(int i = 0; i < c->count; i++){
+        if(!queueEmpty(c->classes[i].requests) && (best == -1 || c->classes[i].pass < c->classes[best].pass))
+            best = i;
+    }
+    return best;
+}
+
+// the class with the best aged priority: class index minus one per aging_us its head waited
+// helper function
+static int classesChooseStrict(Classes c){
+    struct timeval now;
+    long best_priority = 0;
+    int best = -1;
+    if(c->aging_us)
+        gettimeofday(&now, NULL);
+    for(int i = 0; i < c->count; i++){
+        if(queueEmpty(c->classes[i].requests))
+            continue;
+        long priority = i;
+        if(c->aging_us){
+            struct timeval arrival = queueHeadArrivalTime(c->classes[i].requests);
+            priority -= ((now.tv_sec - arrival.tv_sec) * 1000000L + now.tv_usec - arrival.tv_usec) / c->aging_us;
+        }
+        if(best == -1 || priority < best_priority){
+            best = i;
+            best_priority = priority;
+        }
+    }
+    return best;
+}
+
+int classesPick(Classes c, int only, struct timeval *arrival){
+    int cls = only;
+    if(cls == -1)
+        cls = c->dispatch == CLASSES_WFQ ? classesChooseWfq(c) : classesChooseStrict(c);
+    if(cls == -1 || queueEmpty(c->classes[cls].requests))
+        return -1;
+    struct Class *class = &c->classes[cls];
+    if(only == -1){        // a class' own threads do not use up its shares
+        c->vtime = class->pass;
+        class->pass += CLASSES_STRIDE / class->weight;
+    }
+    *arrival = queueHeadArrivalTime(class->requests);
+    return dequeue(class->requests);
+}
+
+// class 0 holds the REAL requests, which are never dropped (as the vip queue)
+// helper function
+static int classesLeastImportant(Classes c){
+    for(int i = c->count - 1; i >= 1; i--){
+        if(!queueEmpty(c->classes[i].requests))
+            return i;
+    }
+    return -1;
+}
+
+int classesDropHead(Classes c, struct timeval *arrival){
+    int cls = classesLeastImportant(c);
+    if(cls == -1)
+        return -1;
+    *arrival = queueHeadArrivalTime(c->classes[cls].requests);
+    return dequeue(c->classes[cls].requests);
+}
+
+int classesDropTail(Classes c, struct timeval *arrival){
+    int cls = classesLeastImportant(c);
+    if(cls == -1)
+        return -1;
+    *arrival = queueTailArrivalTime(c->classes[cls].requests);
+    return dequeueTail(c->classes[cls].requests);
+}
+
+int classesDropRandom(Classes c, int *victims){
+    struct Eviction e;
+    evictionStart(&e, classesWaiting(c) - classesWaitingIn(c, 0), victims);
+    for(int i = 1; i < c->count; i++)
+        queueDropRandom(c->classes[i].requests, &e);
+    return e.count;
+}
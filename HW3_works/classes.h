@@ -0,0 +1,51 @@
+#ifndef CLASSES_H
+#define CLASSES_H
+
+#include <sys/time.h>
+
+//
+// classes.c: N priority classes of waiting requests, replacing the vip queue
+// and the single vip thread when --classes is given.
+//
+// Class 0 is the most important. Every class has its own FIFO queue and a
+// weight, and may have threads of its own that serve only it. The shared
+// workers pick the next class by the dispatch policy:
+//  - CLASSES_WFQ: weighted fair (stride scheduling). Over time a class with
+//    weight w gets w shares of the dispatches among the classes that have work.
+//  - CLASSES_STRICT: the most important class with work goes first; with aging,
+//    a request moves up one class for every aging_ms it has waited, so the low
+//    classes are delayed but never starved.
+// Not thread safe: the server lock guards it, like the other waiting queues.
+//
+
+#define CLASSES_WFQ 1
+#define CLASSES_STRICT 2
+#define CLASSES_MAX 16
+
+typedef struct Classes *Classes;
+
+// weights[i] >= 1 for each of the count classes, each queue holds up to size requests
+Classes classesCreate(int count, const int *weights, int size, int dispatch, int aging_ms);
+
+int classesCount(Classes c);
+
+// requests waiting in all classes / in one class
+int classesWaiting(Classes c);
+int classesWaitingIn(Classes c, int cls);
+
+void classesPush(Classes c, int cls, int descriptor, struct timeval arrival);
+
+// take the next request to start: from class only, or (only == -1) from the
+// class chosen by the dispatch policy. -1 if there is none
+int classesPick(Classes c, int only, struct timeval *arrival);
+
+// remove the oldest / newest waiting request of the least important class with work,
+// -1 if none. class 0 (REAL requests) is never dropped
+int classesDropHead(Classes c, struct timeval *arrival);
+int classesDropTail(Classes c, struct timeval *arrival);
+
+// unlink half of the waiting requests (rounded up), picked at random over all classes
+// but class 0 (policy "random"). their descriptors go to victims, returns how many
+int classesDropRandom(Classes c, int *victims);
+
+#endif // CLASSES_H
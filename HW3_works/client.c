@@ -1,56 +1,60 @@
-#include "segel.h"
-#include <pthread.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-
-
-
-// int main(int argc, char *argv[]) {
-//     printf("\n=== Running Automated Server Tests ===\n");
-//     runServerTest();
-//     return 0;
-// }
-
 /*
- * client.c: A very, very primitive HTTP client.
- * 
- * To run, try: 
- *      ./client www.cs.technion.ac.il 80 /
+ * client.c: A primitive HTTP client, and a load generator.
+ *
+ * To run, try:
+ *      ./client www.cs.technion.ac.il 80 / GET
  *
  * Sends one HTTP request to the specified HTTP server.
  * Prints out the HTTP response.
  *
- * HW3: For testing your server, you will want to modify this client.  
- * For example:
- * 
- * You may want to make this multi-threaded so that you can 
- * send many requests simultaneously to the server.
+ * Given options instead of a filename, it loads the server and prints a JSON
+ * report (throughput, drops, latency percentiles) on stdout:
  *
- * You may also want to be able to request different URIs; 
- * you may want to get more URIs from the command line 
- * or read the list from a file. 
+ *      ./client localhost 8003 --connections=16 --duration=10 --rate=2000 \
+ *               --uris=mix.txt --real=0.1
  *
- * When we test your server, we will be using modifications to this client.
+ *  --connections=<n>  threads, each with one request on the wire at a time (default 1)
+ *  --duration=<s>     how long to send (default 10)
+ *  --rate=<r>         open loop: r requests/s over all connections, Poisson arrivals.
+ *                     Latency counts from the scheduled send time, so a slow server
+ *                     cannot hide its queueing by slowing us down.
+ *                     Without it: closed loop, the next request leaves when the
+ *                     previous response is in. Either way nothing new is sent
+ *                     after the duration; in open loop what was due by then but
+ *                     could not be sent (every connection was busy) is reported as unsent
+ *  --uris=<file>      one "<uri> [weight]" per line, '#' starts a comment (default /home.html)
+ *  --real=<p>         share of requests sent as REAL (VIP) instead of GET (default 0)
+ *  --timeout=<ms>     a response slower than this counts as a timeout (default 30000)
+ *  --seed=<n>         for the arrivals, the URI mix and the REAL share (default 1)
  *
+ * Every request gets its own connection, like the server expects by default.
+ * A connection closed without a response is a drop (what the dt/dh/random
+ * policies do). The Stat-Req-Dispatch header gives the time the request waited
+ * in the server's queue, reported next to the latency seen by the client.
  */
 
 #include "segel.h"
 
+#define STATUS_DROPPED -1   /* closed without a response */
+#define STATUS_TIMEOUT -2
+#define STATUS_FAILED -3    /* could not connect or send */
+
 /*
- * Send an HTTP request for the specified file 
+ * Send an HTTP request for the specified file
  */
 void clientSend(int fd, char *filename, char* method)
 {
   char buf[MAXLINE];
   char hostname[MAXLINE];
+  int len;
 
   Gethostname(hostname, MAXLINE);
 
   /* Form and send the HTTP request */
-  sprintf(buf, "%s %s HTTP/1.1\n",method, filename);
-  sprintf(buf, "%shost: %s\n\r\n", buf, hostname);
+  len = snprintf(buf, sizeof(buf), "%s %s HTTP/1.1\n", method, filename);
+  if (len >= (int)sizeof(buf))
+    len = sizeof(buf) - 1;
+  snprintf(buf + len, sizeof(buf) - len, "host: %s\n\r\n", hostname);
   printf("%s\n", buf);
   Rio_writen(fd, buf, strlen(buf));
 }
@@ -61,7 +65,7 @@ void clientSend(int fd, char *filename, char* method)
 void clientPrint(int fd)
 {
   rio_t rio;
-  char buf[MAXBUF];  
+  char buf[MAXBUF];
   int length = 0;
   int n;
 
@@ -87,14 +91,370 @@ void clientPrint(int fd)
   }
 }
 
+/*
+ * Load generation
+ */
+
+typedef struct Load_sample{
+  long latency_ns;
+  long dispatch_ns;   /* from Stat-Req-Dispatch, -1 if there was none */
+  int status;         /* HTTP status or STATUS_* */
+  int real;
+} * load_sample;
+
+typedef struct Load_thread{
+  pthread_t tid;
+  unsigned short seed[3];
+  struct Load_sample *samples;
+  int count, capacity;
+  int unsent;   /* open loop: due before the end but never sent */
+} * load_thread;
+
+static struct sockaddr_in load_addr;
+static char load_host[MAXLINE];
+static int load_connections = 1, load_timeout_ms = 30000;
+static double load_duration = 10, load_rate = 0, load_real = 0;
+static long load_start_ns;
+static char **load_uris;
+static double *load_weights;  /* cumulative */
+static int load_uri_count;
+
+static long clientNow()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void clientAddUri(char *uri, double weight)
+{
+  load_uris = realloc(load_uris, (load_uri_count + 1) * sizeof(*load_uris));
+  load_weights = realloc(load_weights, (load_uri_count + 1) * sizeof(*load_weights));
+  if (load_uris == NULL || load_weights == NULL)
+    unix_error("realloc error");
+  load_uris[load_uri_count] = strdup(uri);
+  load_weights[load_uri_count] = weight + (load_uri_count ? load_weights[load_uri_count - 1] : 0);
+  load_uri_count++;
+}
+
+static void clientReadUris(char *path)
+{
+  char line[MAXLINE], uri[MAXLINE];
+  double weight;
+  FILE *file = fopen(path, "r");
+
+  if (file == NULL)
+    unix_error("cannot open the URI file");
+  while (fgets(line, sizeof(line), file)) {
+    char *comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+    weight = 1;
+    if (sscanf(line, "%s %lf", uri, &weight) < 1 || weight <= 0)
+      continue;
+    clientAddUri(uri, weight);
+  }
+  fclose(file);
+  if (load_uri_count == 0)
+    app_error("the URI file has no URIs");
+}
+
+static char *clientPickUri(load_thread t)
+{
+  double x = erand48(t->seed) * load_weights[load_uri_count - 1];
+  int i = 0;
+  while (i < load_uri_count - 1 && x >= load_weights[i])
+    i++;
+  return load_uris[i];
+}
+
+/*
+ * One request on a new connection. Fills in everything but the latency.
+ */
+static void clientRequest(char *uri, int real, load_sample s)
+{
+  char buf[MAXBUF];
+  rio_t rio;
+  long sec, usec;
+  int fd, n;
+  struct timeval timeout = { load_timeout_ms / 1000, (load_timeout_ms % 1000) * 1000 };
+
+  s->real = real;
+  s->dispatch_ns = -1;
+  s->status = STATUS_FAILED;
+  if ((fd = open_clientaddr(&load_addr)) < 0)
+    return;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  n = snprintf(buf, sizeof(buf), "%s %s HTTP/1.0\r\nhost: %s\r\n\r\n", real ? "REAL" : "GET", uri, load_host);
+  if (rio_writen(fd, buf, n) != n) {
+    s->status = STATUS_DROPPED;   /* refused before we were done sending */
+    close(fd);
+    return;
+  }
+
+  Rio_readinitb(&rio, fd);
+  n = rio_readlineb(&rio, buf, sizeof(buf));
+  if (n <= 0 || sscanf(buf, "HTTP/%*s %d", &s->status) != 1) {
+    s->status = (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? STATUS_TIMEOUT : STATUS_DROPPED;
+    close(fd);
+    return;
+  }
+  while ((n = rio_readlineb(&rio, buf, sizeof(buf))) > 0 && strcmp(buf, "\r\n")) {
+    if (sscanf(buf, "Stat-Req-Dispatch:: %ld.%ld", &sec, &usec) == 2)
+      s->dispatch_ns = sec * 1000000000L + usec * 1000L;
+  }
+  /* the server closes the connection at the end of the body */
+  while ((n = rio_readnb(&rio, buf, sizeof(buf))) > 0)
+    ;
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    s->status = STATUS_TIMEOUT;
+  close(fd);
+}
+
+static load_sample clientNewSample(load_thread t)
+{
+  if (t->count == t->capacity) {
+    t->capacity = t->capacity ? t->capacity * 2 : 1024;
+    t->samples = realloc(t->samples, t->capacity * sizeof(*t->samples));
+    if (t->samples == NULL)
+      unix_error("realloc error");
+  }
+  return &t->samples[t->count++];
+}
+
+static void *clientLoadThread(void *arg)
+{
+  load_thread t = (load_thread)arg;
+  long end = load_start_ns + (long)(load_duration * 1e9);
+  long next = load_start_ns;   /* open loop: when the next request is due */
+
+  while (1) {
+    long sent;
+    if (load_rate > 0) {
+      /* exponential gaps between arrivals make a Poisson process */
+      next += (long)(-log(1 - erand48(t->seed)) / (load_rate / load_connections) * 1e9);
+      if (next >= end)
+        break;
+      struct timespec due = { next / 1000000000L, next % 1000000000L };
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+        ;
+      if (clientNow() >= end) {
+        /* too far behind schedule: what is still due is not sent, only counted */
+        for (; next < end; next += (long)(-log(1 - erand48(t->seed)) / (load_rate / load_connections) * 1e9))
+          t->unsent++;
+        break;
+      }
+      sent = next;
+    } else {
+      if ((sent = clientNow()) >= end)
+        break;
+    }
+    char *uri = clientPickUri(t);
+    int real = erand48(t->seed) < load_real;
+    load_sample s = clientNewSample(t);
+    clientRequest(uri, real, s);
+    s->latency_ns = clientNow() - sent;
+  }
+  return NULL;
+}
+
+static int clientCompareLong(const void *a, const void *b)
+{
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Print {"count":..,"mean":..,"p50":..,...} in ms, values is sorted in place
+ */
+static void clientPrintPercentiles(long *values, int n)
+{
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  static const char *names[] = {"p50", "p90", "p99", "p999"};
+  double sum = 0;
+
+  qsort(values, n, sizeof(*values), clientCompareLong);
+  for (int i = 0; i < n; i++)
+    sum += values[i];
+  printf("{\"count\": %d, \"mean\": %.3f", n, n ? sum / n / 1e6 : 0);
+  for (int q = 0; q < 4; q++) {
+    int rank = (int)ceil(quantiles[q] * n);
+    printf(", \"%s\": %.3f", names[q], n ? values[rank > 0 ? rank - 1 : 0] / 1e6 : 0);
+  }
+  printf(", \"max\": %.3f}", n ? values[n - 1] / 1e6 : 0);
+}
+
+/*
+ * Latency (or queue wait) percentiles of the answered requests, for all of them,
+ * GET only and REAL only
+ */
+static void clientPrintLatencies(const char *name, struct Load_sample *samples, int n, int dispatch)
+{
+  static const char *classes[] = {"all", "get", "real"};
+  long *values = malloc((n ? n : 1) * sizeof(*values));
+
+  if (values == NULL)
+    unix_error("malloc error");
+  printf("  \"%s\": {", name);
+  for (int c = 0; c < 3; c++) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+      if (samples[i].status <= 0 || (c == 1 && samples[i].real) || (c == 2 && !samples[i].real))
+        continue;
+      if (dispatch && samples[i].dispatch_ns < 0)
+        continue;
+      values[count++] = dispatch ? samples[i].dispatch_ns : samples[i].latency_ns;
+    }
+    printf("%s\"%s\": ", c ? ", " : "", classes[c]);
+    clientPrintPercentiles(values, count);
+  }
+  printf("}");
+  free(values);
+}
+
+static void clientReport(struct Load_thread *threads, double elapsed)
+{
+  struct Load_sample *all;
+  int n = 0, ok = 0, dropped = 0, timeouts = 0, failed = 0, unsent = 0, statuses[600] = {0};
+
+  for (int i = 0; i < load_connections; i++) {
+    n += threads[i].count;
+    unsent += threads[i].unsent;
+  }
+  if ((all = malloc((n ? n : 1) * sizeof(*all))) == NULL)
+    unix_error("malloc error");
+  n = 0;
+  for (int i = 0; i < load_connections; i++) {
+    memcpy(all + n, threads[i].samples, threads[i].count * sizeof(*all));
+    n += threads[i].count;
+  }
+  for (int i = 0; i < n; i++) {
+    switch (all[i].status) {
+    case STATUS_DROPPED: dropped++; break;
+    case STATUS_TIMEOUT: timeouts++; break;
+    case STATUS_FAILED: failed++; break;
+    default:
+      if (all[i].status >= 0 && all[i].status < 600)
+        statuses[all[i].status]++;
+      if (all[i].status >= 200 && all[i].status < 300)
+        ok++;
+    }
+  }
+
+  printf("{\n");
+  printf("  \"mode\": \"%s\",\n", load_rate > 0 ? "open" : "closed");
+  printf("  \"connections\": %d,\n", load_connections);
+  printf("  \"offered_rate\": %.1f,\n", load_rate);
+  printf("  \"real_share\": %.3f,\n", load_real);
+  printf("  \"duration_s\": %.3f,\n", elapsed);
+  printf("  \"sent\": %d,\n", n);
+  printf("  \"ok\": %d,\n", ok);
+  printf("  \"dropped\": %d,\n", dropped);
+  printf("  \"timeouts\": %d,\n", timeouts);
+  printf("  \"failed\": %d,\n", failed);
+  printf("  \"unsent\": %d,\n", unsent);
+  printf("  \"throughput_rps\": %.1f,\n", (n - dropped - timeouts - failed) / elapsed);
+  printf("  \"goodput_rps\": %.1f,\n", ok / elapsed);
+  printf("  \"drop_rate\": %.4f,\n", n ? (double)dropped / n : 0);
+  printf("  \"status\": {");
+  for (int code = 0, first = 1; code < 600; code++) {
+    if (statuses[code]) {
+      printf("%s\"%d\": %d", first ? "" : ", ", code, statuses[code]);
+      first = 0;
+    }
+  }
+  printf("},\n");
+  clientPrintLatencies("latency_ms", all, n, 0);
+  printf(",\n");
+  clientPrintLatencies("queue_wait_ms", all, n, 1);
+  printf("\n}\n");
+  free(all);
+}
+
+static int clientLoad(char *host, int port, int argc, char *argv[])
+{
+  struct hostent *hp;
+  struct Load_thread *threads;
+  long seed = 1;
+
+  for (int i = 0; i < argc; i++) {
+    char *value = strchr(argv[i], '=');
+    if (value == NULL) {
+      fprintf(stderr, "%s: expected --name=value\n", argv[i]);
+      return 1;
+    }
+    value++;
+    if (!strncmp(argv[i], "--connections=", value - argv[i]))
+      load_connections = atoi(value);
+    else if (!strncmp(argv[i], "--duration=", value - argv[i]))
+      load_duration = atof(value);
+    else if (!strncmp(argv[i], "--rate=", value - argv[i]))
+      load_rate = atof(value);
+    else if (!strncmp(argv[i], "--uris=", value - argv[i]))
+      clientReadUris(value);
+    else if (!strncmp(argv[i], "--real=", value - argv[i]))
+      load_real = atof(value);
+    else if (!strncmp(argv[i], "--timeout=", value - argv[i]))
+      load_timeout_ms = atoi(value);
+    else if (!strncmp(argv[i], "--seed=", value - argv[i]))
+      seed = atol(value);
+    else {
+      fprintf(stderr, "%s: unknown option\n", argv[i]);
+      return 1;
+    }
+  }
+  if (load_connections <= 0 || load_duration <= 0 || load_rate < 0 || load_timeout_ms <= 0) {
+    fprintf(stderr, "connections, duration and timeout must be positive\n");
+    return 1;
+  }
+  if (load_uri_count == 0)
+    clientAddUri("/home.html", 1);
+
+  /* resolved once: gethostbyname is not thread safe */
+  if ((hp = gethostbyname(host)) == NULL)
+    dns_error("gethostbyname error");
+  bzero((char *)&load_addr, sizeof(load_addr));
+  load_addr.sin_family = AF_INET;
+  bcopy((char *)hp->h_addr, (char *)&load_addr.sin_addr.s_addr, hp->h_length);
+  load_addr.sin_port = htons(port);
+  strncpy(load_host, host, sizeof(load_host) - 1);
+  /* a dropped connection must not kill us while we send on it */
+  signal(SIGPIPE, SIG_IGN);
+
+  if ((threads = calloc(load_connections, sizeof(*threads))) == NULL)
+    unix_error("calloc error");
+  load_start_ns = clientNow();
+  for (int i = 0; i < load_connections; i++) {
+    threads[i].seed[0] = (unsigned short)seed;
+    threads[i].seed[1] = (unsigned short)(seed >> 16);
+    threads[i].seed[2] = (unsigned short)i;
+    if (pthread_create(&threads[i].tid, NULL, clientLoadThread, &threads[i]) != 0)
+      unix_error("pthread_create error");
+  }
+  for (int i = 0; i < load_connections; i++)
+    pthread_join(threads[i].tid, NULL);
+
+  clientReport(threads, (clientNow() - load_start_ns) / 1e9);
+  for (int i = 0; i < load_connections; i++)
+    free(threads[i].samples);
+  free(threads);
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
   char *host, *filename, *method;
   int port;
   int clientfd;
 
+  if (argc >= 3 && (argc == 3 || !strncmp(argv[3], "--", 2)))
+    return clientLoad(argv[1], atoi(argv[2]), argc - 3, argv + 3);
+
   if (argc != 5) {
     fprintf(stderr, "Usage: %s <host> <port> <filename> <method>\n", argv[0]);
+    fprintf(stderr, "       %s <host> <port> [--connections=<n>] [--duration=<s>] [--rate=<r>]\n"
+                    "                [--uris=<file>] [--real=<p>] [--timeout=<ms>] [--seed=<n>]\n", argv[0]);
     exit(1);
   }
 
@@ -0,0 +1,67 @@
+#include "codel.h"
+#include "segel.h"
+
+struct Codel {
+    pthread_mutex_t lock;    // shared by all workers unless every worker has its own shard
+    long target_us;
+    long interval_us;
+    long first_above;        // when the sojourn time will have been above target for an interval, 0 if it is not above
+    long drop_next;          // while dropping: when to drop the next request
+    int count;               // drops since we started dropping
+    int last_count;          // count when we stopped dropping the last time
+    int dropping;
+};
+
+Codel codelCreate(int target_ms, int interval_ms){
+    Codel c = (Codel)calloc(1, sizeof(*c));
+    if(c == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    c->target_us = target_ms * 1000L;
+    c->interval_us = interval_ms * 1000L;
+    return c;
+}
+
+// the gap between drops shrinks as interval / sqrt(count)
+// helper function
+static long codelControlLaw(Codel c, long t){
+    return t + (long)(c->interval_us / sqrt(c->count));
+}
+
+int codelDrop(Codel c, struct timeval arrival){
+    struct timeval now_tv;
+    int drop = 0;
+
+    gettimeofday(&now_tv, NULL);
+    long now = now_tv.tv_sec * 1000000L + now_tv.tv_usec;
+    long sojourn = now - (arrival.tv_sec * 1000000L + arrival.tv_usec);
+
+    pthread_mutex_lock(&c->lock);
+    if(sojourn < c->target_us){ // the queue drained, back to normal
+        c->first_above = 0;
+        c->dropping = 0;
+    }
+    else if(c->dropping){
+        if(now >= c->drop_next){
+            drop = 1;
+            c->count++;
+            c->drop_next = codelControlLaw(c, c->drop_next);
+        }
+    }
+    else if(c->first_above == 0){
+        c->first_above = now + c->interval_us;
+    }
+    else if(now >= c->first_above){ // above target for a whole interval: start dropping
+        drop = 1;
+        c->dropping = 1;
+        // dropping again soon after we stopped: the last rate was about right, resume near it
+        int delta = c->count - c->last_count;
+        c->count = (delta > 1 && now - c->drop_next < 16 * c->interval_us) ? delta : 1;
+        c->drop_next = codelControlLaw(c, now);
+        c->last_count = c->count;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return drop;
+}
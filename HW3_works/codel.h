@@ -0,0 +1,27 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <sys/time.h>
+
+//
+// codel.c: CoDel (controlled delay) queue management, for policy "codel".
+//
+// Looks at how long each request waited (its sojourn time) as it leaves the
+// queue. Once the sojourn time stayed above target for a whole interval, the
+// queue is a standing one: the request at the head is dropped, and then more,
+// at a rate growing with the square root of the drop count, until a request
+// gets through in less than target again. This bounds queueing delay instead
+// of queue length, and leaves short bursts alone.
+//
+
+#define CODEL_TARGET_MS 5
+#define CODEL_INTERVAL_MS 100
+
+typedef struct Codel *Codel;
+
+Codel codelCreate(int target_ms, int interval_ms);
+
+// the request that arrived at arrival is leaving the queue now: 1 if it should be dropped instead
+int codelDrop(Codel c, struct timeval arrival);
+
+#endif // CODEL_H
@@ -0,0 +1,113 @@
+#include "flight.h"
+#include "segel.h"
+
+#define FLIGHT_BUCKETS 1024
+
+struct Flight {
+    pthread_mutex_t lock;
+    pthread_cond_t done;    // some call is done, its waiters check their own
+    long ttl_ms;
+    flight_call buckets[FLIGHT_BUCKETS];
+};
+
+Flight flightCreate(int ttl_ms){
+    Flight f = (Flight)calloc(1, sizeof(*f));
+    if(f == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->done, NULL);
+    f->ttl_ms = ttl_ms;
+    return f;
+}
+
+// helper function
+static unsigned flightHash(const char *key){
+    unsigned hash = 5381;
+    while(*key)
+        hash = hash * 33 + (unsigned char)*key++;
+    return hash % FLIGHT_BUCKETS;
+}
+
+// helper function
+static long elapsedMs(struct timespec from, struct timespec to){
+    return (to.tv_sec - from.tv_sec) * 1000 + (to.tv_nsec - from.tv_nsec) / 1000000;
+}
+
+// helper function
+static void flightFree(flight_call call){
+    free(call->data);
+    free(call->key);
+    free(call);
+}
+
+// take a call out of the table, it is freed once the last caller releases it
+// the caller holds f->lock
+// helper function
+static void flightRemove(Flight f, flight_call call){
+    if(call->removed)
+        return;
+    flight_call *link = &f->buckets[flightHash(call->key)];
+    while(*link != call)
+        link = &(*link)->next;
+    *link = call->next;
+    call->removed = 1;
+    if(call->refcount == 0)
+        flightFree(call);
+}
+
+flight_call flightJoin(Flight f, const char *key, int *leader){
+    struct timespec now;
+    flight_call call, next;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&f->lock);
+    for(call = f->buckets[flightHash(key)]; call; call = next){
+        next = call->next;
+        if(call->done && elapsedMs(call->finished, now) >= f->ttl_ms)
+            flightRemove(f, call);   // expired results go when their bucket is next looked at
+        else if(strcmp(call->key, key) == 0)
+            break;
+    }
+    if(call){
+        call->refcount++;
+        *leader = 0;
+        while(!call->done)
+            pthread_cond_wait(&f->done, &f->lock);
+        pthread_mutex_unlock(&f->lock);
+        return call;
+    }
+
+    if((call = (flight_call)calloc(1, sizeof(*call))) == NULL || (call->key = strdup(key)) == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    unsigned bucket = flightHash(key);
+    call->next = f->buckets[bucket];
+    f->buckets[bucket] = call;
+    call->refcount = 1;
+    *leader = 1;
+    pthread_mutex_unlock(&f->lock);
+    return call;
+}
+
+void flightDone(Flight f, flight_call call, char *data, size_t len){
+    pthread_mutex_lock(&f->lock);
+    call->data = data;
+    call->len = len;
+    call->done = 1;
+    clock_gettime(CLOCK_MONOTONIC, &call->finished);
+    if(data == NULL || f->ttl_ms == 0)   // nothing for the callers still to come
+        flightRemove(f, call);
+    pthread_cond_broadcast(&f->done);
+    pthread_mutex_unlock(&f->lock);
+}
+
+void flightRelease(Flight f, flight_call call){
+    pthread_mutex_lock(&f->lock);
+    call->refcount--;
+    if(call->removed && call->refcount == 0)
+        flightFree(call);
+    pthread_mutex_unlock(&f->lock);
+}
@@ -0,0 +1,44 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stddef.h>
+#include <time.h>
+
+//
+// flight.c: single flight for work whose result identical requests can share.
+//
+// The first caller for a key is the leader: it does the work and hands the
+// result to flightDone. Callers that join the key meanwhile wait for it and get
+// the same result instead of doing the work again, so a burst of N identical
+// requests costs one run. A result is kept for ttl_ms after it was made and
+// handed to later callers as well (0: only to those that waited for it).
+//
+
+typedef struct Flight *Flight;
+
+typedef struct Flight_call{
+	char *data;           // the shared result, NULL if the leader could not make one
+	size_t len;
+
+	// managed by flight.c
+	char *key;
+	int done;
+	struct timespec finished;
+	int refcount;
+	int removed;
+	struct Flight_call *next;
+} * flight_call;
+
+Flight flightCreate(int ttl_ms);
+
+// the call for key. The leader (*leader set) must flightDone it, everyone else
+// gets it once it is done. Every caller must flightRelease it
+flight_call flightJoin(Flight f, const char *key, int *leader);
+
+// publish the leader's result, data is malloc'd and taken over (NULL: failed,
+// the callers that waited do the work themselves)
+void flightDone(Flight f, flight_call call, char *data, size_t len);
+
+void flightRelease(Flight f, flight_call call);
+
+#endif // FLIGHT_H
@@ -0,0 +1,169 @@
+#include "log.h"
+#include "segel.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+#define LOG_OUT_SIZE 65536
+
+int log_level = LOG_OFF;
+
+struct LogRecord {
+    long ns;                        // since logInit
+    int level;
+    char text[LOG_RECORD_SIZE];
+};
+
+// single producer (the owning thread), single consumer (the flusher)
+struct LogRing {
+    _Alignas(CACHE_LINE) atomic_ulong head;   // next record the flusher reads
+    _Alignas(CACHE_LINE) atomic_ulong tail;   // next record the owner writes
+    atomic_ulong dropped;                     // records lost to a full ring
+    int id;                                   // worker id of the owner, -1 for the other threads
+    struct LogRing *next;
+    struct LogRecord records[LOG_RING_SIZE];
+};
+
+static _Atomic(struct LogRing *) rings;      // every ring ever created, newest first
+static __thread struct LogRing *my_ring;
+static struct timespec log_start;
+static int log_fd;
+
+// helper function
+static long logNow(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - log_start.tv_sec) * 1000000000L + (now.tv_nsec - log_start.tv_nsec);
+}
+
+// the first record of a thread creates its ring
+// helper function
+static struct LogRing *logRing(int id){
+    struct LogRing *ring;
+    if(posix_memalign((void **)&ring, CACHE_LINE, sizeof(*ring)) != 0)
+        return NULL;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->id = id;
+    ring->next = atomic_load(&rings);
+    while(!atomic_compare_exchange_weak(&rings, &ring->next, ring))
+        ;
+    return ring;
+}
+
+void logSelf(int id){
+    if(my_ring || log_level == LOG_OFF)
+        return;
+    for(struct LogRing *ring = atomic_load(&rings); ring; ring = ring->next){
+        if(ring->id == id){   // a worker id that came back (elastic pool) carries on writing its predecessor's ring
+            my_ring = ring;
+            return;
+        }
+    }
+    my_ring = logRing(id);
+}
+
+void logWrite(int level, const char *fmt, ...){
+    va_list args;
+    if(my_ring == NULL && (my_ring = logRing(-1)) == NULL)
+        return;
+
+    unsigned long tail = atomic_load_explicit(&my_ring->tail, memory_order_relaxed);
+    if(tail - atomic_load_explicit(&my_ring->head, memory_order_acquire) == LOG_RING_SIZE){
+        atomic_fetch_add_explicit(&my_ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    struct LogRecord *record = &my_ring->records[tail & (LOG_RING_SIZE - 1)];
+    record->ns = logNow();
+    record->level = level;
+    va_start(args, fmt);
+    vsnprintf(record->text, sizeof(record->text), fmt, args);
+    va_end(args);
+    atomic_store_explicit(&my_ring->tail, tail + 1, memory_order_release);
+}
+
+// helper function
+static void logOut(char *out, int *len){
+    if(*len > 0 && rio_writen(log_fd, out, *len) < 0)
+        perror("log write");
+    *len = 0;
+}
+
+// helper function
+static void logRecordOut(struct LogRecord *record, char *out, int *len){
+    static const char levels[] = "-EID";
+    if(LOG_OUT_SIZE - *len < LOG_RECORD_SIZE + 32)
+        logOut(out, len);
+    *len += snprintf(out + *len, LOG_OUT_SIZE - *len, "%ld.%06ld %c %s\n", record->ns / 1000000000L,
+                     (record->ns / 1000) % 1000000, levels[record->level], record->text);
+}
+
+// copy the records of all rings to log_fd, merged by time, then sleep a little.
+// The only thread that may block on output
+// helper function
+static void *logFlusher(void *arg){
+    char *out = malloc(LOG_OUT_SIZE);
+    int len = 0;
+    struct timespec pause = {0, LOG_FLUSH_MS * 1000000L};
+
+    if(out == NULL){
+        perror("malloc failed");
+        return NULL;
+    }
+    while(1){
+        while(1){ // the oldest unread record of any ring goes first
+            struct LogRing *oldest = NULL;
+            unsigned long oldest_head = 0;
+            for(struct LogRing *ring = atomic_load(&rings); ring; ring = ring->next){
+                unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+                if(head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+                    continue;
+                if(oldest == NULL || ring->records[head & (LOG_RING_SIZE - 1)].ns
+                                     < oldest->records[oldest_head & (LOG_RING_SIZE - 1)].ns){
+                    oldest = ring;
+                    oldest_head = head;
+                }
+            }
+            if(oldest == NULL)
+                break;
+            logRecordOut(&oldest->records[oldest_head & (LOG_RING_SIZE - 1)], out, &len);
+            atomic_store_explicit(&oldest->head, oldest_head + 1, memory_order_release);
+        }
+        for(struct LogRing *ring = atomic_load(&rings); ring; ring = ring->next){
+            unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+            if(dropped){
+                if(LOG_OUT_SIZE - len < 64)
+                    logOut(out, &len);
+                len += snprintf(out + len, LOG_OUT_SIZE - len, "log: %lu records dropped\n", dropped);
+            }
+        }
+        logOut(out, &len);
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+void logInit(int level, int fd){
+    pthread_t flusher;
+    clock_gettime(CLOCK_MONOTONIC, &log_start);
+    log_fd = fd;
+    log_level = level;
+    if(level == LOG_OFF)
+        return;
+    if(pthread_create(&flusher, NULL, logFlusher, NULL) != 0){
+        perror("pthread_create");
+        log_level = LOG_OFF;
+        return;
+    }
+    pthread_detach(flusher);
+}
+
+int logParseLevel(const char *name){
+    static const char *names[] = {"off", "error", "info", "debug"};
+    for(int level = LOG_OFF; level <= LOG_DEBUG; level++){
+        if(strcmp(name, names[level]) == 0)
+            return level;
+    }
+    return -1;
+}
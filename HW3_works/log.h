@@ -0,0 +1,41 @@
+#ifndef LOG_H
+#define LOG_H
+
+//
+// log.c: asynchronous logging that never blocks the calling thread.
+//
+// Every thread that logs gets its own ring of fixed size records, written only
+// by that thread and read only by a background flusher, so logging takes no
+// lock. A record is one line of text, stamped with the time since logInit.
+// When a ring is full the record is dropped and counted instead of waiting.
+//
+
+#define LOG_OFF 0
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG_RECORD_SIZE 128   // longer lines are cut
+#define LOG_RING_SIZE 1024    // records per thread, a power of 2
+#define LOG_FLUSH_MS 50
+
+extern int log_level;
+
+// start the flusher thread, records are written to fd
+void logInit(int level, int fd);
+
+// give the calling thread the ring of the earlier thread with the same worker id,
+// or a new one. Threads that do not call it get a ring of their own on first record
+void logSelf(int id);
+
+// queue one line (no trailing newline needed), use the macros below instead
+void logWrite(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define logError(...) do { if (log_level >= LOG_ERROR) logWrite(LOG_ERROR, __VA_ARGS__); } while (0)
+#define logInfo(...) do { if (log_level >= LOG_INFO) logWrite(LOG_INFO, __VA_ARGS__); } while (0)
+#define logDebug(...) do { if (log_level >= LOG_DEBUG) logWrite(LOG_DEBUG, __VA_ARGS__); } while (0)
+
+// parse "off", "error", "info" or "debug", -1 if none of them
+int logParseLevel(const char *name);
+
+#endif // LOG_H
@@ -0,0 +1,179 @@
+#include "metrics.h"
+#include "segel.h"
+
+static _Atomic(thread_metrics) all_metrics;  // every block, newest first
+static __thread thread_metrics my_metrics;
+static __thread long phase_stamp;            // end of the caller's previous phase
+static struct timespec metrics_start;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+
+// helper function
+static void metricsStart(){
+    clock_gettime(CLOCK_MONOTONIC, &metrics_start);
+}
+
+thread_metrics metricsSelf(int id){
+    if(my_metrics)
+        return my_metrics;
+    pthread_once(&metrics_once, metricsStart);
+    thread_metrics m;
+    for(m = atomic_load(&all_metrics); id >= 0 && m; m = m->next){
+        if(m->id == id)    // a worker id that came back (elastic pool) carries on its predecessor's counts
+            return my_metrics = m;
+    }
+    if(posix_memalign((void **)&m, 64, sizeof(*m)) != 0){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(m, 0, sizeof(*m));
+    m->id = id;
+    m->next = atomic_load(&all_metrics);
+    while(!atomic_compare_exchange_weak(&all_metrics, &m->next, m))
+        ;
+    return my_metrics = m;
+}
+
+long metricsNow(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// values below HIST_SUB get a bucket each, then every power of 2 gets HIST_SUB of them
+// helper function
+static int histBucket(long ns){
+    if(ns < HIST_SUB)
+        return ns < 0 ? 0 : ns;
+    int msb = 63 - __builtin_clzl(ns);
+    if(msb > HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + (int)(ns >> (msb - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+// the largest value that falls in a bucket
+// helper function
+static long histBucketTop(int bucket){
+    if(bucket < HIST_SUB)
+        return bucket;
+    int shift = bucket / HIST_SUB - 1;
+    return ((long)(bucket % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+void metricsRecord(int phase, long ns){
+    if(my_metrics == NULL)
+        return;
+    metricsAdd(my_metrics->hist[phase][histBucket(ns)], 1);
+    metricsAdd(my_metrics->hist_sum[phase], ns);
+}
+
+void metricsPhaseStart(long ns){
+    phase_stamp = ns;
+}
+
+void metricsPhase(int phase){
+    long now = metricsNow();
+    metricsRecord(phase, now - phase_stamp);
+    phase_stamp = now;
+}
+
+#define LOAD(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+// helper function
+static int metricsHeader(char *buf, int size, const char *name, const char *type, const char *help){
+    return snprintf(buf, size, "# HELP oshw3_%s %s\n# TYPE oshw3_%s %s\n", name, help, name, type);
+}
+
+// the value at quantile q of a merged histogram, in seconds
+// helper function
+static double histQuantile(const long *hist, long count, double q){
+    long rank = (long)(q * count + 0.999999), seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        seen += hist[i];
+        if(seen >= rank && seen > 0)
+            return histBucketTop(i) / 1e9;
+    }
+    return 0;
+}
+
+int metricsRender(char *buf, int size){
+    static const char *policies[METRICS_POLICIES] = {"dt", "dh", "bf", "random", "codel", "deadline"};
+    static const char *phases[METRICS_PHASES] = {"queue", "parse", "open", "send", "cgi", "total"};
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    struct Thread_metrics sum;
+    struct timespec now;
+    int len = 0;
+
+    // counters only grow, so read the consumers before the producers: a gauge may lag but never goes negative
+    memset(&sum, 0, sizeof(sum));
+    for(thread_metrics m = atomic_load(&all_metrics); m; m = m->next){
+        metricsAdd(sum.finished, LOAD(m->finished));
+        metricsAdd(sum.vip_finished, LOAD(m->vip_finished));
+        metricsAdd(sum.static_req, LOAD(m->static_req));
+        metricsAdd(sum.dynamic_req, LOAD(m->dynamic_req));
+    }
+    for(thread_metrics m = atomic_load(&all_metrics); m; m = m->next){
+        metricsAdd(sum.started, LOAD(m->started));
+        metricsAdd(sum.vip_started, LOAD(m->vip_started));
+    }
+    for(thread_metrics m = atomic_load(&all_metrics); m; m = m->next){
+        metricsAdd(sum.accepted, LOAD(m->accepted));
+        metricsAdd(sum.admitted, LOAD(m->admitted));
+        metricsAdd(sum.vip_admitted, LOAD(m->vip_admitted));
+        metricsAdd(sum.evicted, LOAD(m->evicted));
+        for(int i = 0; i < METRICS_POLICIES; i++)
+            metricsAdd(sum.dropped[i], LOAD(m->dropped[i]));
+    }
+    long waiting = LOAD(sum.admitted) - LOAD(sum.started) - LOAD(sum.evicted);
+    long vip_waiting = LOAD(sum.vip_admitted) - LOAD(sum.vip_started);
+    long handling = LOAD(sum.started) - LOAD(sum.finished) + LOAD(sum.vip_started) - LOAD(sum.vip_finished);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+// where the next line goes and the room left for it, both stay inside buf once it is full
+#define OUT buf + (len < size ? len : size), (len < size ? size - len : 0)
+    len += metricsHeader(OUT, "waiting_requests", "gauge", "Regular requests waiting for a worker.");
+    len += snprintf(OUT, "oshw3_waiting_requests %ld\n", waiting > 0 ? waiting : 0);
+    len += metricsHeader(OUT, "vip_waiting_requests", "gauge", "VIP requests waiting for the vip thread.");
+    len += snprintf(OUT, "oshw3_vip_waiting_requests %ld\n", vip_waiting > 0 ? vip_waiting : 0);
+    len += metricsHeader(OUT, "handling_requests", "gauge", "Requests being handled.");
+    len += snprintf(OUT, "oshw3_handling_requests %ld\n", handling > 0 ? handling : 0);
+    len += metricsHeader(OUT, "accepted_connections_total", "counter", "Connections accepted.");
+    len += snprintf(OUT, "oshw3_accepted_connections_total %ld\n", LOAD(sum.accepted));
+    len += metricsHeader(OUT, "admitted_requests_total", "counter", "Requests put in a queue.");
+    len += snprintf(OUT, "oshw3_admitted_requests_total{class=\"regular\"} %ld\n", LOAD(sum.admitted));
+    len += snprintf(OUT, "oshw3_admitted_requests_total{class=\"vip\"} %ld\n", LOAD(sum.vip_admitted));
+    len += metricsHeader(OUT, "dropped_requests_total", "counter", "Requests dropped by the overload policy.");
+    for(int i = 0; i < METRICS_POLICIES; i++)
+        len += snprintf(OUT, "oshw3_dropped_requests_total{policy=\"%s\"} %ld\n", policies[i], LOAD(sum.dropped[i]));
+    len += metricsHeader(OUT, "requests_total", "counter", "Requests handled, over all threads.");
+    len += snprintf(OUT, "oshw3_requests_total{type=\"static\"} %ld\n", LOAD(sum.static_req));
+    len += snprintf(OUT, "oshw3_requests_total{type=\"dynamic\"} %ld\n", LOAD(sum.dynamic_req));
+    len += metricsHeader(OUT, "thread_requests_total", "counter", "Requests handled by each thread.");
+    for(thread_metrics m = atomic_load(&all_metrics); m; m = m->next){
+        if(m->id < 0)
+            continue;
+        len += snprintf(OUT, "oshw3_thread_requests_total{thread=\"%d\",type=\"static\"} %ld\n", m->id, LOAD(m->static_req));
+        len += snprintf(OUT, "oshw3_thread_requests_total{thread=\"%d\",type=\"dynamic\"} %ld\n", m->id, LOAD(m->dynamic_req));
+    }
+    len += metricsHeader(OUT, "phase_seconds", "summary", "Time spent in each phase of a request.");
+    for(int p = 0; p < METRICS_PHASES; p++){
+        long hist[HIST_BUCKETS], count = 0, total_ns = 0;
+        for(int i = 0; i < HIST_BUCKETS; i++){
+            hist[i] = 0;
+            for(thread_metrics m = atomic_load(&all_metrics); m; m = m->next)
+                hist[i] += LOAD(m->hist[p][i]);
+            count += hist[i];
+        }
+        for(thread_metrics m = atomic_load(&all_metrics); m; m = m->next)
+            total_ns += LOAD(m->hist_sum[p]);
+        for(int q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++)
+            len += snprintf(OUT, "oshw3_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                            phases[p], quantiles[q], histQuantile(hist, count, quantiles[q]));
+        len += snprintf(OUT, "oshw3_phase_seconds_sum{phase=\"%s\"} %.9f\n", phases[p], total_ns / 1e9);
+        len += snprintf(OUT, "oshw3_phase_seconds_count{phase=\"%s\"} %ld\n", phases[p], count);
+    }
+    len += metricsHeader(OUT, "uptime_seconds", "gauge", "Seconds since the server started.");
+    len += snprintf(OUT, "oshw3_uptime_seconds %.3f\n",
+                    (now.tv_sec - metrics_start.tv_sec) + (now.tv_nsec - metrics_start.tv_nsec) / 1e9);
+#undef OUT
+    return len;
+}
@@ -0,0 +1,81 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+
+//
+// metrics.c: live counters, rendered in the Prometheus text format.
+//
+// Every thread that counts something owns a Thread_metrics block and is the
+// only one writing it, so counting is a plain relaxed store on a private cache
+// line and never takes the server lock. A scrape sums the blocks of all threads;
+// the queue sizes are derived from those sums.
+//
+// Each block also holds a latency histogram per request phase. The buckets grow
+// exponentially, each power of 2 split into HIST_SUB linear steps (HDR style), so
+// a bucket is never more than 1/HIST_SUB wider than its values and the
+// histograms of all threads merge by adding bucket counts.
+//
+
+#define METRICS_DT 0
+#define METRICS_DH 1
+#define METRICS_BF 2
+#define METRICS_RANDOM 3
+#define METRICS_CODEL 4
+#define METRICS_EXPIRED 5     // deadline passed while waiting
+#define METRICS_POLICIES 6
+
+// request phases, timed on CLOCK_MONOTONIC
+#define PHASE_QUEUE 0    // arrival to a thread picking it up
+#define PHASE_PARSE 1    // header lines that arrived after admission
+#define PHASE_OPEN 2     // cache lookup, stat and open
+#define PHASE_SEND 3     // header and static body
+#define PHASE_CGI 4      // header and the CGI program's run
+#define PHASE_TOTAL 5    // arrival to the response being sent
+#define METRICS_PHASES 6
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40                                   // ~18 minutes in ns, longer is counted there
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB)
+
+typedef struct Thread_metrics{
+	int id;                                  // worker id, -1 for the master
+	// master
+	atomic_long accepted;                    // connections
+	atomic_long admitted, vip_admitted;      // requests put in a queue
+	atomic_long dropped[METRICS_POLICIES];   // requests dropped by each overload policy (codel, expired: by the workers)
+	atomic_long evicted;                     // of those, the ones taken out of a queue
+	// workers and the vip thread
+	atomic_long started, finished;           // regular requests
+	atomic_long vip_started, vip_finished;
+	atomic_long static_req, dynamic_req;
+	atomic_long hist[METRICS_PHASES][HIST_BUCKETS];   // ns
+	atomic_long hist_sum[METRICS_PHASES];
+	struct Thread_metrics *next;
+} __attribute__((aligned(64))) * thread_metrics;
+
+// the calling thread's block, created the first time or taken over from an
+// earlier thread with the same worker id
+thread_metrics metricsSelf(int id);
+
+// add n to a counter of the caller's own block
+#define metricsAdd(counter, n) \
+	atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+
+// CLOCK_MONOTONIC in ns
+long metricsNow();
+
+// add one sample to a histogram of the caller's own block
+void metricsRecord(int phase, long ns);
+
+// time phases back to back: metricsPhase records the time since the previous
+// call (or since metricsPhaseStart) under phase
+void metricsPhaseStart(long ns);
+void metricsPhase(int phase);
+
+// write the current metrics to buf, returns their whole length like snprintf:
+// if that is size or more the text was cut, call again with a larger buffer
+int metricsRender(char *buf, int size);
+
+#endif // METRICS_H
@@ -35,10 +35,12 @@ double Time_GetSeconds() {
 }
 
 
-int main(int argc, char *argv[])
+void serveRequest()
 {
   char content[MAXBUF];
+  int len = 0;
 
+  id = -1;
   getargs();
 
   double t1 = Time_GetSeconds();
@@ -46,10 +48,10 @@ int main(int argc, char *argv[])
   double t2 = Time_GetSeconds();
 
   /* Make the response body */
-  sprintf(content, "<p>Welcome to the CGI program</p>\r\n");
-  sprintf(content, "%s<p>My only purpose is to waste time on the server!</p>\r\n", content);
-  sprintf(content, "%s<p>I spun for %.2f seconds</p>\r\n", content, t2 - t1);
-  sprintf(content, "%s<p>Your ID is: %d</p>\r\n", content, id);
+  len += snprintf(content + len, sizeof(content) - len, "<p>Welcome to the CGI program</p>\r\n");
+  len += snprintf(content + len, sizeof(content) - len, "<p>My only purpose is to waste time on the server!</p>\r\n");
+  len += snprintf(content + len, sizeof(content) - len, "<p>I spun for %.2f seconds</p>\r\n", t2 - t1);
+  len += snprintf(content + len, sizeof(content) - len, "<p>Your ID is: %d</p>\r\n", id);
 
   /* Generate the HTTP response */
   printf("Content-length: %lu\r\n", strlen(content));
@@ -57,7 +59,35 @@ int main(int argc, char *argv[])
   printf("%s", content);
 
   fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  char query[MAXLINE], ack = 'D';
+  int fd;
+
+  if (getenv("CGI_LOOP") == NULL) {
+    serveRequest();
+    exit(0);
+  }
 
+  /* Loop mode: the server's CGI pool sends each request over stdin,
+     with the client socket attached, and waits for ack when we are done */
+  int idle_stdout = dup(STDOUT_FILENO);
+  if (write(STDIN_FILENO, "R", 1) != 1)
+    exit(1);
+  while (recv_fd(STDIN_FILENO, &fd, query, sizeof(query) - 1) > 0) {
+    if (fd < 0)
+      continue;
+    query[sizeof(query) - 1] = '\0';
+    setenv("QUERY_STRING", query, 1);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    serveRequest();
+    dup2(idle_stdout, STDOUT_FILENO); /* let go of the client socket before the ack */
+    if (write(STDIN_FILENO, &ack, 1) != 1)
+      break;
+  }
   exit(0);
 }
 
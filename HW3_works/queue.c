@@ -1,34 +1,64 @@
 #include "queue.h"
 #include "segel.h"
 
+// a queue slot: one accepted connection waiting (or being handled)
 struct Request {
     int descriptor;
     struct timeval arrival;
-    Request next;
 };
 
+// bounded ring buffer: all max_size slots are allocated once in queueCreate,
+// so enqueue/dequeue never touch the allocator while the server lock is held.
+// the i-th request in the queue (0 = head) lives in slots[(head + i) % max_size]
 struct Queue {
     int max_size;
     int current_size;
-    Request head;
-    Request tail;
+    int head;
+    Request slots;
 };
 
-// Given a descriptor, create a new request
+// in-flight requests, one slot per descriptor: the kernel hands out the lowest
+// free descriptor, so the table stays about as big as the number of open connections.
+// add/remove/lookup are a single array access instead of a scan of the queue
+struct Inflight {
+    int capacity;
+    int current_size;
+    struct Request *slots;  // slots[fd].descriptor == fd while fd is in flight, -1 otherwise
+};
+
+// waiting requests that carry a deadline, as a binary min-heap on the deadline:
+// slots[0] is the earliest, the children of slots[i] are slots[2i+1] and slots[2i+2]
+struct Deadline_request {
+    int descriptor;
+    struct timeval arrival;
+    long deadline;
+};
+
+struct Heap {
+    int max_size;
+    int current_size;
+    struct Deadline_request *slots;
+};
+
+// translate a position in the queue (0 = head) to a slot in the ring
 // helper function
-Request requestCreate(int descriptor, struct timeval arrival){
-    Request node = (Request)malloc(sizeof(*node));
-    node->descriptor = descriptor;
-    node->arrival = arrival;
-    node->next = NULL;
-    return node;
+static Request queueSlot(Queue q, int index){
+    return &q->slots[(q->head + index) % q->max_size];
 }
 
 // Create empty queue of max_size = size
 Queue queueCreate(int size){
-    Queue q = (Queue)malloc(sizeof(Queue*));
-    q->head = NULL;
-    q->tail = NULL;
+    Queue q = (Queue)malloc(sizeof(*q));
+    if(q == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    q->slots = (Request)malloc(sizeof(struct Request) * size);
+    if(q->slots == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    q->head = 0;
     q->current_size = 0;
     q->max_size = size;
     return q;
@@ -55,14 +85,9 @@ void enqueue(Queue q, int descriptor, struct timeval arrival){
     if(queueFull(q))
         return;
 
-    Request new_node = requestCreate(descriptor, arrival);
-    if(queueEmpty(q)){
-        q->head = new_node;
-        q->tail = new_node;
-    } else {
-        q->tail->next = new_node;
-        q->tail = new_node;
-    }
+    Request slot = queueSlot(q, q->current_size);
+    slot->descriptor = descriptor;
+    slot->arrival = arrival;
     q->current_size++;
 }
 
@@ -71,71 +96,53 @@ void enqueue(Queue q, int descriptor, struct timeval arrival){
 int dequeue(Queue q){
     if(queueEmpty(q))
         return -1;
-    Request new_head = q->head->next;
-    int descriptor = q->head->descriptor;
-    free(q->head);
-    if(new_head == NULL){
-        q->head = NULL;
-        q->tail = NULL;
-    } else {
-        q->head = new_head;
-    }
+    int descriptor = queueSlot(q, 0)->descriptor;
+    q->head = (q->head + 1) % q->max_size;
     q->current_size--;
     return descriptor;
 }
 
-
 // pop tail request and return it's descriptor, if empty, returns -1.
-// used for policy dt, drop the latest request in the regular waiting queue 
-// int dequeueTail(Queue q){
-//     if(queueEmpty(q))
-//         return -1;
-//     Request tail = q->tail;
-//     Request new_tail = q->head;
-//     int descriptor = q->tail->descriptor;
-
-//     if(new_tail == NULL){
-//         q->head = NULL;
-//         q->tail = NULL;
-//     } else {
-//         while(new_tail->next != tail) {
-//             new_tail = new_tail->next;
-//         }
-//         new_tail->next = NULL;
-//     }
-
-//     free(q->tail);
-//     q->current_size--;
-//     return descriptor;
-// }
-
+// used for policy dt, drop the latest request in the regular waiting queue
 int dequeueTail(Queue q){
-    return dequeueByIndex(q, queueSize(q)-1);
+    if(queueEmpty(q))
+        return -1;
+    q->current_size--;
+    return queueSlot(q, q->current_size)->descriptor;
 }
-// for policy - random
-void randomDequeue(Queue q) {
-    if(queueEmpty(q)) {
-        return;
-    }
-    int num_req_to_be_deleted = (q->current_size + 1)/ 2;
-    int deleted = 0;
-    Request r = q->head;
 
-    while(deleted <= num_req_to_be_deleted) {
-        if(r == q->tail->next) {                //if at the end of the list but still in loop, return to head of the queue
-            r = q->head;                        //meaning we haven't killed enough in the list
-        }
+void evictionStart(eviction e, int waiting, int *victims){
+    e->wanted = (waiting + 1) / 2;
+    e->left = waiting;
+    e->count = 0;
+    e->victims = victims;
+}
 
-        int rand_index = rand() % 2;            //deciding if we want to kill - 1 for kill, 0 for spare
-        if(rand_index) {                        //1 - kill
-            int fd_to_be_deleted = q->head->descriptor;
-            Close(fd_to_be_deleted);
-            dequeueByReq(q, fd_to_be_deleted);
-            deleted++;
-        }
-        r = r->next;
+// decide on one request, true if it is a victim
+// helper function
+static int evictionPick(eviction e, int descriptor){
+    if(e->left <= 0)
+        return 0;
+    int victim = rand() % e->left < e->wanted;
+    e->left--;
+    if(victim){
+        e->wanted--;
+        e->victims[e->count++] = descriptor;
     }
+    return victim;
+}
 
+// for policy - random: one sweep, the survivors slide towards the head
+int queueDropRandom(Queue q, eviction e){
+    int kept = 0;
+    for(int i = 0; i < q->current_size; i++){
+        Request slot = queueSlot(q, i);
+        if(!evictionPick(e, slot->descriptor))
+            *queueSlot(q, kept++) = *slot;
+    }
+    int dropped = q->current_size - kept;
+    q->current_size = kept;
+    return dropped;
 }
 
 // pop the latest request == the last in queue
@@ -151,35 +158,29 @@ int skipDequeue(Queue q){
 int headDesciprot(Queue q){
     if(queueEmpty(q))
         return -1;
-    return q->head->descriptor;
+    return queueSlot(q, 0)->descriptor;
 }
 
 // return time of arrival of head request (first added), if empty returns 0
 struct timeval queueHeadArrivalTime(Queue q){
     if(queueEmpty(q))
         return (struct timeval){0};
-    return q->head->arrival;
+    return queueSlot(q, 0)->arrival;
 }
 
-// return time of arrival of head request (first added), if empty returns 0
+// return time of arrival of tail request (last added), if empty returns 0
 struct timeval queueTailArrivalTime(Queue q){
     if(queueEmpty(q))
         return (struct timeval){0};
-    return q->tail->arrival;
+    return queueSlot(q, q->current_size - 1)->arrival;
 }
 
 // return the index in queue of request, if not found or empty return -1.
 int queueFindReq(Queue q, int descriptor){
-    if(queueEmpty(q))
-        return -1;
-    Request temp = q->head;
-    int index = 0;
-    while(temp){
-        if(descriptor == temp->descriptor){
+    for(int index = 0; index < q->current_size; index++){
+        if(descriptor == queueSlot(q, index)->descriptor){
             return index;
         }
-        index++;
-        temp = temp->next;
     }
     return -1;
 }
@@ -193,79 +194,40 @@ void dequeueByReq(Queue q, int descriptor){
     dequeueByIndex(q, index);
 }
 
+// pop request in the given index, if empty or invalid index return -1, else return the descriptor of the request
+// the gap is closed from whichever end of the ring is closer
 int dequeueByIndex(Queue q, int index)
 {
-    // assume element num exists in the queue
     if (index >= queueSize(q) || index < 0)
     {
         return -1;
     }
-    if (index == 0)
-    {
-        return dequeue(q);
-    }
-    Request prev_wanted_request = NULL;
-    Request wanted_request = q->head;
-    for (int i = 0; i < index; i++)
+    int wanted_descriptor = queueSlot(q, index)->descriptor;
+    if (index < q->current_size / 2)
     {
-        prev_wanted_request = wanted_request;
-        wanted_request = wanted_request->next;
+        for (int i = index; i > 0; i--)
+        {
+            *queueSlot(q, i) = *queueSlot(q, i - 1);
+        }
+        q->head = (q->head + 1) % q->max_size;
     }
-
-    int wanted_descriptor = wanted_request->descriptor;
-    prev_wanted_request->next = wanted_request->next;
-    free(wanted_request);
-    if (index == queueSize(q) - 1)
+    else
     {
-        q->tail = prev_wanted_request;
+        for (int i = index; i < q->current_size - 1; i++)
+        {
+            *queueSlot(q, i) = *queueSlot(q, i + 1);
+        }
     }
     q->current_size--;
     return wanted_descriptor;
 }
 
-// // pop request in the given index, if empty or invalid index return -1, else return the descriptor of the request
-// int dequeueByIndex(Queue q, int index){
-//     if(queueEmpty(q))
-//         return -1;
-
-//     if(index < 0 || index >= queueSize(q))
-//         return -1;
-
-//     if(index == 0){
-//         return dequeue(q);
-//     }
-
-//     Request node_to_dequeue = q->head;
-//     Request prev_node = NULL;
-//     for(int i = 0; i < index; i++){
-//         prev_node = node_to_dequeue;
-//         node_to_dequeue = node_to_dequeue->next;
-//     }
-
-//     int value = node_to_dequeue->descriptor;
-//     prev_node->next = node_to_dequeue->next;
-//     free(node_to_dequeue);
-//     if(index == queueSize(q) - 1){
-//         q->tail = prev_node;
-//     }
-//     q->current_size--;
-
-//     return value;
-// }
-
 int queueSize(Queue q){
     return q->current_size;
 }
 
 void queueDestroy(Queue q){
-    Request current = q->head;
-    Request next = NULL;
-    while (current){
-        next = current->next;
-        free(current);
-        current = next;
-    }
-
+    free(q->slots);
     free(q);
 }
 
@@ -275,10 +237,8 @@ void debug(Queue q){
         return;
     }
 
-    Request temp = q->head;
-    while (temp){
-        printf("%d ", temp->descriptor);
-        temp = temp->next;
+    for (int i = 0; i < q->current_size; i++){
+        printf("%d ", queueSlot(q, i)->descriptor);
     }
     printf("\n");
 }
@@ -290,10 +250,217 @@ void queuePrint(Queue q){
     }
 
     printf("Queue (size: %d/%d): ", q->current_size, q->max_size);
-    Request temp = q->head;
-    while (temp){
+    for (int i = 0; i < q->current_size; i++){
+        Request temp = queueSlot(q, i);
         printf("[Descriptor: %d | Arrival: %ld.%06ld] -> ", temp->descriptor, temp->arrival.tv_sec, temp->arrival.tv_usec);
-        temp = temp->next;
     }
     printf("NULL\n");
-}
\ No newline at end of file
+}
+
+static void inflightGrow(Inflight t, int descriptor);
+
+// Create empty in-flight table, size is only a hint for the initial capacity
+Inflight inflightCreate(int size){
+    Inflight t = (Inflight)malloc(sizeof(*t));
+    if(t == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    t->slots = NULL;
+    t->capacity = 0;
+    t->current_size = 0;
+    inflightGrow(t, size);
+    return t;
+}
+
+// make sure descriptor has a slot, doubling the table as needed
+// helper function
+static void inflightGrow(Inflight t, int descriptor){
+    if(descriptor < t->capacity)
+        return;
+    int new_capacity = t->capacity ? t->capacity : 16;
+    while(new_capacity <= descriptor)
+        new_capacity *= 2;
+    struct Request *slots = (struct Request *)realloc(t->slots, sizeof(struct Request) * new_capacity);
+    if(slots == NULL){
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = t->capacity; i < new_capacity; i++)
+        slots[i].descriptor = -1;
+    t->slots = slots;
+    t->capacity = new_capacity;
+}
+
+int inflightSize(Inflight t){
+    return t->current_size;
+}
+
+// return true if the descriptor is being handled
+int inflightContains(Inflight t, int descriptor){
+    return descriptor >= 0 && descriptor < t->capacity && t->slots[descriptor].descriptor == descriptor;
+}
+
+// mark descriptor as handled, if already there does nothing
+void inflightAdd(Inflight t, int descriptor, struct timeval arrival){
+    if(descriptor < 0 || inflightContains(t, descriptor))
+        return;
+    inflightGrow(t, descriptor);
+    t->slots[descriptor].descriptor = descriptor;
+    t->slots[descriptor].arrival = arrival;
+    t->current_size++;
+}
+
+// forget a handled descriptor, if not there does nothing
+void inflightRemove(Inflight t, int descriptor){
+    if(!inflightContains(t, descriptor))
+        return;
+    t->slots[descriptor].descriptor = -1;
+    t->current_size--;
+}
+
+// return time of arrival of a handled request, if not there returns 0
+struct timeval inflightArrivalTime(Inflight t, int descriptor){
+    if(!inflightContains(t, descriptor))
+        return (struct timeval){0};
+    return t->slots[descriptor].arrival;
+}
+
+void inflightDestroy(Inflight t){
+    free(t->slots);
+    free(t);
+}
+
+// Create empty deadline heap of max_size = size
+Heap heapCreate(int size){
+    Heap h = (Heap)malloc(sizeof(*h));
+    if(h == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    h->slots = (struct Deadline_request *)malloc(sizeof(struct Deadline_request) * size);
+    if(h->slots == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    h->max_size = size;
+    h->current_size = 0;
+    return h;
+}
+
+int heapSize(Heap h){
+    return h->current_size;
+}
+
+int heapEmpty(Heap h){
+    return h->current_size == 0;
+}
+
+// helper function
+static void heapSwap(Heap h, int i, int j){
+    struct Deadline_request temp = h->slots[i];
+    h->slots[i] = h->slots[j];
+    h->slots[j] = temp;
+}
+
+// helper function
+static void heapSiftUp(Heap h, int i){
+    while(i > 0 && h->slots[(i - 1) / 2].deadline > h->slots[i].deadline){
+        heapSwap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+// helper function
+static void heapSiftDown(Heap h, int i){
+    while(1){
+        int earliest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if(left < h->current_size && h->slots[left].deadline < h->slots[earliest].deadline)
+            earliest = left;
+        if(right < h->current_size && h->slots[right].deadline < h->slots[earliest].deadline)
+            earliest = right;
+        if(earliest == i)
+            return;
+        heapSwap(h, i, earliest);
+        i = earliest;
+    }
+}
+
+// take out slots[i], keeping the heap in order
+// helper function
+static int heapRemoveAt(Heap h, int i, struct timeval *arrival, long *deadline){
+    int descriptor = h->slots[i].descriptor;
+    if(arrival)
+        *arrival = h->slots[i].arrival;
+    if(deadline)
+        *deadline = h->slots[i].deadline;
+    h->current_size--;
+    if(i < h->current_size){
+        h->slots[i] = h->slots[h->current_size];
+        heapSiftUp(h, i);
+        heapSiftDown(h, i);
+    }
+    return descriptor;
+}
+
+// add new request to heap, if full does nothing
+void heapPush(Heap h, int descriptor, struct timeval arrival, long deadline){
+    if(h->current_size == h->max_size)
+        return;
+    struct Deadline_request *slot = &h->slots[h->current_size];
+    slot->descriptor = descriptor;
+    slot->arrival = arrival;
+    slot->deadline = deadline;
+    heapSiftUp(h, h->current_size++);
+}
+
+// pop the request with the earliest deadline and return its descriptor, if empty, returns -1.
+int heapPop(Heap h, struct timeval *arrival, long *deadline){
+    if(heapEmpty(h))
+        return -1;
+    return heapRemoveAt(h, 0, arrival, deadline);
+}
+
+// pop the request with the latest deadline (the least urgent), if empty, returns -1.
+// it is one of the leaves, the second half of the slots
+int heapPopLatest(Heap h, struct timeval *arrival){
+    if(heapEmpty(h))
+        return -1;
+    int latest = h->current_size / 2;
+    for(int i = latest + 1; i < h->current_size; i++){
+        if(h->slots[i].deadline > h->slots[latest].deadline)
+            latest = i;
+    }
+    return heapRemoveAt(h, latest, arrival, NULL);
+}
+
+// for policy - random: the survivors are compacted, then made a heap again.
+// returns how many were dropped
+int heapDropRandom(Heap h, eviction e){
+    int kept = 0;
+    for(int i = 0; i < h->current_size; i++){
+        if(!evictionPick(e, h->slots[i].descriptor))
+            h->slots[kept++] = h->slots[i];
+    }
+    int dropped = h->current_size - kept;
+    h->current_size = kept;
+    for(int i = h->current_size / 2 - 1; i >= 0; i--) // rebuilt bottom up, linear
+        heapSiftDown(h, i);
+    return dropped;
+}
+
+void heapPrint(Heap h){
+    if(heapEmpty(h)){
+        printf("Heap is empty\n");
+        return;
+    }
+    printf("Heap (size: %d/%d): ", h->current_size, h->max_size);
+    for(int i = 0; i < h->current_size; i++)
+        printf("[Descriptor: %d | Deadline: %ld] ", h->slots[i].descriptor, h->slots[i].deadline);
+    printf("\n");
+}
+
+void heapDestroy(Heap h){
+    free(h->slots);
+    free(h);
+}
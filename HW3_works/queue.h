@@ -5,8 +5,22 @@
 
 typedef struct Queue *Queue;
 typedef struct Request *Request;
-
-Request requestCreate(int descriptor, struct timeval arrival);
+typedef struct Inflight *Inflight;
+typedef struct Heap *Heap;
+
+// random eviction (policy "random") over one or more queues and heaps as one pass
+// of selection sampling: every request looked at is a victim with probability
+// wanted / left, so exactly wanted of them go and every subset is equally likely.
+// Victims are only unlinked; the caller closes them once the lock is released.
+typedef struct Eviction{
+    int wanted;     // victims still to pick
+    int left;       // requests not looked at yet
+    int count;      // victims picked so far
+    int *victims;   // their descriptors
+} * eviction;
+
+// pick ceil(waiting / 2) of the next waiting requests, victims has room for them
+void evictionStart(eviction e, int waiting, int *victims);
 
 Queue queueCreate(int size);
 
@@ -27,7 +41,8 @@ int dequeue(Queue q);
 
 int dequeueTail(Queue q);
 
-void randomDequeue(Queue q);
+// drop the victims among q's requests, the others keep their order. returns how many
+int queueDropRandom(Queue q, eviction e);
 
 int skipDequeue(Queue q);
 
@@ -43,4 +58,38 @@ void queueDestroy(Queue q);
 
 void queuePrint(Queue q);
 
+// set of requests currently being handled, indexed by descriptor
+Inflight inflightCreate(int size);
+
+int inflightSize(Inflight t);
+
+int inflightContains(Inflight t, int descriptor);
+
+void inflightAdd(Inflight t, int descriptor, struct timeval arrival);
+
+void inflightRemove(Inflight t, int descriptor);
+
+struct timeval inflightArrivalTime(Inflight t, int descriptor);
+
+void inflightDestroy(Inflight t);
+
+// waiting requests ordered by deadline (earliest first), for deadline-tagged requests
+Heap heapCreate(int size);
+
+int heapSize(Heap h);
+
+int heapEmpty(Heap h);
+
+void heapPush(Heap h, int descriptor, struct timeval arrival, long deadline);
+
+int heapPop(Heap h, struct timeval *arrival, long *deadline);
+
+int heapPopLatest(Heap h, struct timeval *arrival);
+
+int heapDropRandom(Heap h, eviction e);
+
+void heapPrint(Heap h);
+
+void heapDestroy(Heap h);
+
 #endif // QUEUE_H
\ No newline at end of file
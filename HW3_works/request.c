@@ -2,65 +2,193 @@
 // request.c: Does the bulk of the work for the web server.
 // 
 
+#define _GNU_SOURCE /* memmem, memfd_create */
 #include "segel.h"
 #include "request.h"
-
-
-// requestError(      fd,    filename,        "404",    "Not found", "OS-HW3 Server could not find this file");
-void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
+#include "log.h"
+#include "uring.h"
+#include <stdarg.h>
+#include <netinet/tcp.h>
+
+int static_send_mode = STATIC_SENDFILE;
+Cache static_cache = NULL;
+CgiPool cgi_pool = NULL;
+Flight cgi_flights = NULL;
+int keepalive_timeout_ms = 0;
+int keepalive_max = 100;
+
+// A response header, put together line by line in a single pass
+typedef struct Header{
+	char buf[MAXBUF];
+	int len;
+} * header;
+
+static void headerAppend(header h, const char *fmt, ...)
 {
-	char buf[MAXLINE], body[MAXBUF];
-
-	// Create the body of the error message
-	sprintf(body, "<html><title>OS-HW3 Error</title>");
-	sprintf(body, "%s<body bgcolor=""fffff"">\r\n", body);
-	sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-	sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-	sprintf(body, "%s<hr>OS-HW3 Web Server\r\n", body);
-
-	// Write out the header information for this response
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_writen(fd, buf, strlen(buf));
-	printf("%s", buf);
-
-	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_writen(fd, buf, strlen(buf));
-	printf("%s", buf);
+	va_list args;
+	int room = sizeof(h->buf) - h->len;
+
+	va_start(args, fmt);
+	int n = vsnprintf(h->buf + h->len, room, fmt, args);
+	va_end(args);
+	if (n > 0)
+		h->len += n < room ? n : room - 1;
+}
 
-	sprintf(buf, "Content-Length: %lu\r\n", strlen(body));
+// "Connection: keep-alive" lines for a response that leaves the connection open
+static void headerConnection(header h, connection conn)
+{
+	if (conn->keep_alive)
+		headerAppend(h, "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n",
+		             (keepalive_timeout_ms + 999) / 1000, keepalive_max - conn->requests);
+}
 
+// the Stat-* lines every response carries
+static void headerStats(header h, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
+{
+	headerAppend(h, "Stat-Req-Arrival:: %lu.%06lu\r\n", arrival.tv_sec, arrival.tv_usec);
+	headerAppend(h, "Stat-Req-Dispatch:: %lu.%06lu\r\n", dispatch.tv_sec, dispatch.tv_usec);
+	headerAppend(h, "Stat-Thread-Id:: %d\r\n", t_stats->id);
+	headerAppend(h, "Stat-Thread-Count:: %d\r\n", t_stats->total_req);
+	headerAppend(h, "Stat-Thread-Static:: %d\r\n", t_stats->stat_req);
+	headerAppend(h, "Stat-Thread-Dynamic:: %d\r\n", t_stats->dynm_req);
+}
 
-	sprintf(buf, "%sStat-Req-Arrival:: %lu.%06lu\r\n", buf, arrival.tv_sec, arrival.tv_usec);
+// the client closed its end: what is left of the response goes nowhere, and the connection ends
+// helper function
+static int requestPeerGone(int err)
+{
+	return err == EPIPE || err == ECONNRESET;
+}
 
-	sprintf(buf, "%sStat-Req-Dispatch:: %lu.%06lu\r\n", buf, dispatch.tv_sec, dispatch.tv_usec);
+// send the header and the body with a single writev, -1 if the client went away
+static int requestSend(int fd, header h, void *body, size_t size)
+{
+	struct iovec iov[2];
+	iov[0].iov_base = h->buf;
+	iov[0].iov_len = h->len;
+	iov[1].iov_base = body;
+	iov[1].iov_len = size;
+	if (rio_writev(fd, iov, size ? 2 : 1) < 0) {
+		if (!requestPeerGone(errno))
+			unix_error("Rio_writev error");
+		return -1;
+	}
+	return 0;
+}
 
-	sprintf(buf, "%sStat-Thread-Id:: %d\r\n", buf, t_stats->id);
+// hold back partial frames while the parts of a response are written separately
+static void requestCork(int fd, int on)
+{
+#ifdef TCP_CORK
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+}
 
-	sprintf(buf, "%sStat-Thread-Count:: %d\r\n", buf, t_stats->total_req);
+// requestError(      conn,    filename,        "404",    "Not found", "OS-HW3 Server could not find this file");
+void requestError(connection conn, char *cause, char *errnum, char *shortmsg, char *longmsg, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
+{
+	struct Header h = { .len = 0 };
+	char body[MAXBUF];
+	int body_len = 0;
 
-	sprintf(buf, "%sStat-Thread-Static:: %d\r\n", buf, t_stats->stat_req);
+	// Create the body of the error message
+	body_len += snprintf(body + body_len, sizeof(body) - body_len, "<html><title>OS-HW3 Error</title>");
+	body_len += snprintf(body + body_len, sizeof(body) - body_len, "<body bgcolor=""fffff"">\r\n");
+	body_len += snprintf(body + body_len, sizeof(body) - body_len, "%s: %s\r\n", errnum, shortmsg);
+	body_len += snprintf(body + body_len, sizeof(body) - body_len, "<p>%s: %s\r\n", longmsg, cause);
+	body_len += snprintf(body + body_len, sizeof(body) - body_len, "<hr>OS-HW3 Web Server\r\n");
+	if (body_len >= (int)sizeof(body))
+		body_len = sizeof(body) - 1;
 
-	sprintf(buf, "%sStat-Thread-Dynamic:: %d\r\n\r\n", buf, t_stats->dynm_req);
-	Rio_writen(fd, buf, strlen(buf));
-	printf("%s", buf);
-	Rio_writen(fd, body, strlen(body));
-	printf("%s", body);
+	// Write out the header information for this response
+	headerAppend(&h, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+	headerAppend(&h, "Content-Type: text/html\r\n");
+	headerAppend(&h, "Content-Length: %d\r\n", body_len);
+	headerConnection(&h, conn);
+	headerStats(&h, arrival, dispatch, t_stats);
+	headerAppend(&h, "\r\n");
+
+	if (requestSend(conn->fd, &h, body, body_len) < 0)
+		conn->keep_alive = 0;
+	logInfo("%s %s: %s", errnum, shortmsg, cause);
+}
 
+// the value of a header line if it is the header name, NULL if not
+static char *requestHeaderValue(char *line, char *next, const char *name)
+{
+	size_t len = strlen(name);
+	if (next - line <= (long)len || strncasecmp(line, name, len))
+		return NULL;
+	char *value = line + len;
+	while (value < next && (*value == ' ' || *value == '\t'))
+		value++;
+	return value;
 }
 
+// take in the header lines of head, up to the empty line that ends them
+static void requestHeaders(http_request req, rio_view_t *head)
+{
+	char *line = head->data, *end = head->data + head->len, *value;
+
+	// the lines are scanned in place, every one of them ends at its '\n'
+	while (line < end && !req->headers_done) {
+		char *next = memchr(line, '\n', end - line);
+		next = next ? next + 1 : end;
+		if (next - line == 2 && line[0] == '\r') {
+			req->headers_done = 1;
+		} else if ((value = requestHeaderValue(line, next, "Connection:"))) {
+			if (next - value >= 10 && !strncasecmp(value, "keep-alive", 10))
+				req->persistent = 1;
+			else if (next - value >= 5 && !strncasecmp(value, "close", 5))
+				req->persistent = 0;
+		} else if ((value = requestHeaderValue(line, next, "Deadline:"))) {
+			if (req->est == 0)   // est= in the uri comes first
+				req->est = atol(value);
+		} else if ((value = requestHeaderValue(line, next, "Priority:"))) {
+			req->priority = atoi(value);
+		}
+		line = next;
+	}
+}
 
 //
-// Reads and discards everything up to an empty text line
+// Reads the header lines the acceptor did not get to, up to the empty text line
 //
-void requestReadhdrs(rio_t *rp)
+void requestReadhdrs(rio_t *rp, http_request req)
 {
-	char buf[MAXLINE];
+	rio_view_t head;
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+	// every call gets as many whole header lines as the buffer holds
+	while (!req->headers_done && Rio_readheadv(rp, &head) > 0)
+		requestHeaders(req, &head);
+}
+
+// copy the next space separated token of *rest into out, like sscanf's %s
+static void requestNextToken(rio_view_t *rest, char *out, size_t outlen)
+{
+	char *p = rest->data, *end = rest->data + rest->len;
+	while (p < end && isspace((unsigned char)*p))
+		p++;
+	char *start = p;
+	while (p < end && !isspace((unsigned char)*p))
+		p++;
+	size_t len = (size_t)(p - start) < outlen - 1 ? (size_t)(p - start) : outlen - 1;
+	memcpy(out, start, len);
+	out[len] = '\0';
+	rest->len = end - p;
+	rest->data = p;
+}
+
+// the est=<ms> parameter of the uri's query, NULL if there is none
+static char *requestDeadlineParam(char *uri)
+{
+	char *query = strchr(uri, '?');
+	for (char *p = query; p; p = strchr(p + 1, '&')) {
+		if (!strncmp(p + 1, "est=", 4))
+			return p + 1;
 	}
-	return;
+	return NULL;
 }
 
 //
@@ -70,13 +198,14 @@ void requestReadhdrs(rio_t *rp)
 int requestParseURI(char *uri, char *filename, char *cgiargs)
 {
 	char *ptr;
-	// if (ptr = strstr(uri, "est=")) {
-	// 	char* end_arg; 
-	// 	if (end_arg = strstr(uri, "&"))
-	// 		memmove(ptr, end_arg + 1, strlen(end_arg));
-	// 	else
-	// 		ptr = '\0';
-	// }
+	// the deadline was read by the acceptor, it is not part of the resource
+	if ((ptr = requestDeadlineParam(uri))) {
+		char *end_arg = strchr(ptr, '&');
+		if (end_arg)
+			memmove(ptr, end_arg + 1, strlen(end_arg + 1) + 1);
+		else
+			ptr[-1] = '\0';   // with the '?' or '&' in front of it
+	}
 	if (strstr(uri, "..")) {
 		sprintf(filename, "./public/home.html");
 		return 1;
@@ -118,32 +247,19 @@ void requestGetFiletype(char *filename, char *filetype)
 		strcpy(filetype, "text/plain");
 }
 
-void requestServeDynamic(int fd, char *filename, char *cgiargs, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
+// run the CGI program on fd: in a pooled process if it can, forked otherwise
+static void requestRunCgi(int fd, char *filename, char *cgiargs)
 {
-	char buf[MAXLINE], *emptylist[] = {NULL};
-
-	// The server does only a little bit of the header.
-	// The CGI script has to finish writing out the header.
-	sprintf(buf, "HTTP/1.0 200 OK\r\n");
-	sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
-
-	sprintf(buf, "%sStat-Req-Arrival:: %lu.%06lu\r\n", buf, arrival.tv_sec, arrival.tv_usec);
-
-	sprintf(buf, "%sStat-Req-Dispatch:: %lu.%06lu\r\n", buf, dispatch.tv_sec, dispatch.tv_usec);
-
-	sprintf(buf, "%sStat-Thread-Id:: %d\r\n", buf, t_stats->id);
+	char *emptylist[] = {NULL};
 
-	sprintf(buf, "%sStat-Thread-Count:: %d\r\n", buf, t_stats->total_req);
-
-	sprintf(buf, "%sStat-Thread-Static:: %d\r\n", buf, t_stats->stat_req);
-
-	sprintf(buf, "%sStat-Thread-Dynamic:: %d\r\n", buf, t_stats->dynm_req);
-
-	Rio_writen(fd, buf, strlen(buf));
+	if (cgi_pool && cgiPoolServe(cgi_pool, filename, cgiargs, fd) == 0) {
+		return;
+	}
    	int pid = 0;
    	if ((pid = Fork()) == 0) {
      	 /* Child process */
      	 Setenv("QUERY_STRING", cgiargs, 1);
+     	 signal(SIGPIPE, SIG_DFL); // the server ignores it, the program gets the usual default
      	 /* When the CGI process writes to stdout, it will instead go to the socket */
      	 Dup2(fd, STDOUT_FILENO);
      	 Execve(filename, emptylist, environ);
@@ -151,127 +267,351 @@ void requestServeDynamic(int fd, char *filename, char *cgiargs, struct timeval a
   	WaitPid(pid, NULL, WUNTRACED);
 }
 
+// run the CGI program with its output going to memory instead of a socket,
+// NULL if it could not be captured
+static char *requestCaptureCgi(char *filename, char *cgiargs, size_t *len)
+{
+	int out = memfd_create("cgi-output", MFD_CLOEXEC);
+	if (out < 0) {
+		return NULL;
+	}
+	requestRunCgi(out, filename, cgiargs);
+	off_t size = lseek(out, 0, SEEK_END);   // the program wrote through a dup of out, at its offset
+	char *data = size < 0 ? NULL : malloc(size ? size : 1);
+	if (data && pread(out, data, size, 0) != size) {
+		free(data);
+		data = NULL;
+	}
+	Close(out);
+	*len = size;
+	return data;
+}
 
-void requestServeStatic(int fd, char *filename, int filesize, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
+void requestServeDynamic(int fd, char *filename, char *cgiargs, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
 {
-	int srcfd;
-	char *srcp, filetype[MAXLINE], buf[MAXBUF];
+	struct Header h = { .len = 0 };
+	char key[MAXLINE * 2 + 1];
+	int leader;
+
+	// The server does only a little bit of the header.
+	// The CGI script has to finish writing out the header.
+	headerAppend(&h, "HTTP/1.0 200 OK\r\n");
+	headerAppend(&h, "Server: OS-HW3 Web Server\r\n");
+	headerStats(&h, arrival, dispatch, t_stats);
+
+	if (cgi_flights) {
+		// the first request for this program and query runs it, the identical
+		// ones meanwhile (or within the ttl) send its output after their own header
+		snprintf(key, sizeof(key), "%s?%s", filename, cgiargs);
+		flight_call call = flightJoin(cgi_flights, key, &leader);
+		if (leader) {
+			size_t len = 0;
+			char *data = requestCaptureCgi(filename, cgiargs, &len);
+			flightDone(cgi_flights, call, data, len);
+		}
+		if (call->data) {
+			requestSend(fd, &h, call->data, call->len);
+			flightRelease(cgi_flights, call);
+			return;
+		}
+		flightRelease(cgi_flights, call);   // not captured, run it for this request alone
+	}
+
+	// corked until the CGI program is done, so our part and its part leave in the same segments
+	requestCork(fd, 1);
+	if (requestSend(fd, &h, NULL, 0) == 0)
+		requestRunCgi(fd, filename, cgiargs);
+	requestCork(fd, 0);
+}
+
+
+void requestServeStatic(connection conn, char *filename, int filesize, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
+{
+	struct Header h = { .len = 0 };
+	int fd = conn->fd, srcfd;
+	char *srcp, filetype[MAXLINE];
 
 	requestGetFiletype(filename, filetype);
 
 	srcfd = Open(filename, O_RDONLY, 0);
+	metricsPhase(PHASE_OPEN);
+
+	// put together response
+	headerAppend(&h, "HTTP/1.0 200 OK\r\n");
+	headerAppend(&h, "Server: OS-HW3 Web Server\r\n");
+	headerAppend(&h, "Content-Length: %d\r\n", filesize);
+	headerAppend(&h, "Content-Type: %s\r\n", filetype);
+	headerConnection(&h, conn);
+	headerStats(&h, arrival, dispatch, t_stats);
+	headerAppend(&h, "\r\n");
+
+	if (static_send_mode == STATIC_SENDFILE) {
+		// the header waits for the first part of the file (MSG_MORE), then
+		// the kernel copies the file from the page cache straight into the socket.
+		// With io_uring both go out in one linked submission
+		ssize_t sent = uringSendfile(fd, h.buf, h.len, srcfd, filesize);
+		if (sent < 0 && errno == ENOSYS) {
+			if (rio_sendn(fd, h.buf, h.len, MSG_MORE) != h.len && !requestPeerGone(errno))
+				unix_error("Rio_sendn error");
+			sent = rio_sendfile(fd, srcfd, 0, filesize);
+		}
+		if (sent == filesize || (sent < 0 && requestPeerGone(errno))) {
+			if (sent < 0)
+				conn->keep_alive = 0;
+			Close(srcfd);
+			metricsPhase(PHASE_SEND);
+			return;
+		}
+		if (errno != EINVAL && errno != ENOSYS)
+			unix_error("Rio_sendfile error");
+		// sendfile does not support this file, send it the old way
+		h.len = 0;
+	}
 
 	// Rather than call read() to read the file into memory,
 	// which would require that we allocate a buffer, we memory-map the file
 	srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
 	Close(srcfd);
 
-	// put together response
-	sprintf(buf, "HTTP/1.0 200 OK\r\n");
-	sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
-	sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-	sprintf(buf, "%sContent-Type: %s\r\n", buf, filetype);
-	sprintf(buf, "%sStat-Req-Arrival:: %lu.%06lu\r\n", buf, arrival.tv_sec, arrival.tv_usec);
+	//  Writes out to the client socket the header and the memory-mapped file
+	if (requestSend(fd, &h, srcp, filesize) < 0)
+		conn->keep_alive = 0;
+	Munmap(srcp, filesize);
+	metricsPhase(PHASE_SEND);
+}
+
+// Serve a static file from the cache: no stat, open or mmap
+void requestServeCached(connection conn, cache_entry entry, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
+{
+	struct Header h = { .len = 0 };
+
+	// everything up to Content-Type was put together when the file was cached
+	headerAppend(&h, "%s", entry->header);
+	headerConnection(&h, conn);
+	headerStats(&h, arrival, dispatch, t_stats);
+	headerAppend(&h, "\r\n");
+
+	if (requestSend(conn->fd, &h, entry->body, entry->size) < 0)
+		conn->keep_alive = 0;
+	metricsPhase(PHASE_SEND);
+}
+
+//  Returns 1 if the whole request line is already readable, 0 if not yet,
+//  -1 if the peer closed the connection or the socket failed.
+//  Never blocks: the acceptor polls this every time epoll reports the socket readable.
+//  The line may start in the connection's buffer (pipelined) and end in the socket.
+int requestLineReady(connection conn)
+{
+	char buf[MAXLINE];
+	int buffered = conn->rio.rio_cnt;
+	if (buffered > 0 && memchr(conn->rio.rio_bufptr, '\n', buffered)) {
+		return 1;
+	}
+	if (buffered >= MAXLINE - 1) {
+		return 1;
+	}
+	int bytesRead = recv(conn->fd, buf, MAXLINE - 1 - buffered, MSG_PEEK | MSG_DONTWAIT);
+	if (bytesRead == 0) {
+		return -1;
+	}
+	if (bytesRead < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	}
+	// an over-long line is handed on as is, the worker will reject it
+	return memchr(buf, '\n', bytesRead) != NULL || buffered + bytesRead == MAXLINE - 1;
+}
 
-	sprintf(buf, "%sStat-Req-Dispatch:: %lu.%06lu\r\n", buf, dispatch.tv_sec, dispatch.tv_usec);
+//  Parse the request whose line requestLineReady found complete. Never blocks:
+//  it reads only what already arrived, header lines still on the way are read by
+//  the worker. A deadline or priority header among those is not seen.
+void requestParse(connection conn)
+{
+	http_request req = &conn->request;
+	rio_t *rio = &conn->rio;
+	rio_view_t line, head;
+	char *ptr, target[MAXLINE];
+
+	req->method[0] = req->uri[0] = req->version[0] = '\0';
+	req->filename[0] = req->cgiargs[0] = '\0';
+	req->is_static = 1;
+	req->is_real = req->skip = req->headers_done = 0;
+	req->est = 0;
+	req->priority = req->persistent = -1;
+
+	if (!memmem(rio->rio_bufptr, rio->rio_cnt, "\n\r\n", 3)) {
+		rio_fillnb(rio);   // the head is not all in yet (the io_uring acceptor may have read it already)
+	}
+	int avail = rio->rio_cnt < MAXLINE - 1 ? rio->rio_cnt : MAXLINE - 1;
+	if (avail < MAXLINE - 1 && !memchr(rio->rio_bufptr, '\n', avail)) {
+		return;   // gone before the line was complete, answered 501
+	}
+	// the request line is split in place, only the three tokens are copied out
+	Rio_readlinev(rio, &line, MAXLINE - 1);
+	requestNextToken(&line, req->method, sizeof(req->method));
+	requestNextToken(&line, req->uri, sizeof(req->uri));
+	requestNextToken(&line, req->version, sizeof(req->version));
+	req->is_real = !strcasecmp(req->method, "REAL");
 
-	sprintf(buf, "%sStat-Thread-Id:: %d\r\n", buf, t_stats->id);
+	// Check for .skip in URI
+	if ((ptr = strstr(req->uri, ".skip"))) {
+		req->skip = 1;
+		// Remove ".skip" from URI
+		memmove(ptr, ptr + SKIP_BYTES, strlen(ptr + SKIP_BYTES) + 1);
+	}
+	if ((ptr = requestDeadlineParam(req->uri))) {
+		req->est = atol(ptr + 4);
+	}
+	while (!req->headers_done && rio_readheadvnb(rio, &head) > 0) {
+		requestHeaders(req, &head);
+	}
+	if (req->est < 0) {
+		req->est = 0;
+	}
 
-	sprintf(buf, "%sStat-Thread-Count:: %d\r\n", buf, t_stats->total_req);
+	// the uri stays as sent for the log
+	strcpy(target, req->uri);
+	req->is_static = requestParseURI(target, req->filename, req->cgiargs);
+}
 
-	sprintf(buf, "%sStat-Thread-Static:: %d\r\n", buf, t_stats->stat_req);
+//  Returns True/False if the parsed request is a GET of path
+int requestIsMetrics(connection conn, const char *path)
+{
+	http_request req = &conn->request;
+	size_t len = strcspn(req->uri, "?");
+	return !strcasecmp(req->method, "GET") && strlen(path) == len && !strncmp(req->uri, path, len);
+}
 
-	sprintf(buf, "%sStat-Thread-Dynamic:: %d\r\n\r\n", buf, t_stats->dynm_req);
+// how long a metrics client may take to read its answer before it is dropped
+#define METRICS_SEND_TIMEOUT_S 10
 
-	Rio_writen(fd, buf, strlen(buf));
+// render and send the metrics to the connection arg, then close it
+// helper function
+static void *requestMetricsThread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	struct Header h = { .len = 0 };
+	struct timeval timeout = { .tv_sec = METRICS_SEND_TIMEOUT_S };
+	struct iovec iov[2];
+	int body_len, body_size = MAXBUF * 8;
+	char *body = malloc(body_size);
+
+	while (body != NULL && (body_len = metricsRender(body, body_size)) >= body_size) {
+		// did not fit: grow to what it needed, a little more for what changed meanwhile
+		free(body);
+		body_size = body_len + MAXBUF;
+		body = malloc(body_size);
+	}
+	if (body == NULL) {
+		perror("malloc failed");
+		close(fd);
+		return NULL;
+	}
 
-	//  Writes out to the client socket the memory-mapped file
-	Rio_writen(fd, srcp, filesize);
-	Munmap(srcp, filesize);
+	headerAppend(&h, "HTTP/1.0 200 OK\r\n");
+	headerAppend(&h, "Server: OS-HW3 Web Server\r\n");
+	headerAppend(&h, "Content-Length: %d\r\n", body_len);
+	headerAppend(&h, "Content-Type: text/plain; version=0.0.4\r\n");
+	headerAppend(&h, "Connection: close\r\n\r\n");
+	iov[0].iov_base = h.buf;
+	iov[0].iov_len = h.len;
+	iov[1].iov_base = body;
+	iov[1].iov_len = body_len;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	rio_writev(fd, iov, 2); // a client that went away or stopped reading only loses its answer
+	free(body);
+	close(fd);
+	return NULL;
 }
 
-//  Returns True/False if realtime event
-int getRequestMetaData(int fd )
+// Answer a metrics request without holding up the master: the rest of the request
+// is discarded as far as it arrived, and a thread of its own renders and sends the
+// metrics and closes the connection
+void requestServeMetrics(connection conn)
 {
-	char buf[MAXLINE], method[MAXLINE];
-	int bytesRead  = recv(fd, buf, MAXLINE - 1, MSG_PEEK);
-	 if (bytesRead == -1) {
-		perror("recv");
-		return 1;
-	 }
-	sscanf(buf, "%s ", method);
-	int isRealTime = !strcasecmp(method, "REAL");
-	// char* timepointer; 
-	// if (timepointer = strstr(uri, "est=")) {
-	// 	*est = atoi(timepointer+4);
-	// }else{
-	// 	*est = -1;
-	// }
-	return isRealTime;
+	char discard[MAXBUF];
+	pthread_t thread;
+
+	conn->rio.rio_cnt = 0;
+	while (recv(conn->fd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+		;
+	if (pthread_create(&thread, NULL, requestMetricsThread, (void *)(intptr_t)conn->fd) != 0) {
+		perror("pthread_create");
+		Close(conn->fd);
+		return;
+	}
+	pthread_detach(thread);
 }
 
 
 // handle a request
-int requestHandle(int fd, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
+static int requestRespond(connection conn, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
 {
 //	sleep(5); //EVA
-	int is_static, skip_invoked = 0;
+	http_request req = &conn->request;
 	struct stat sbuf;
-	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	char filename[MAXLINE], cgiargs[MAXLINE];
-	rio_t rio;
-
-	Rio_readinitb(&rio, fd);
-	Rio_readlineb(&rio, buf, MAXLINE);
-	sscanf(buf, "%s %s %s", method, uri, version);
 
 	(t_stats->total_req)++;
+	conn->requests++;
+	conn->keep_alive = 0;
+	logInfo("%s %s %s", req->method, req->uri, req->version);
 
-    // Check for .skip
-    if (strstr(filename, ".skip") != NULL) {
-        skip_invoked = 1;
-        // Remove ".skip" from filename
-        *strstr(filename, ".skip") = '\0';
-    }
-
-	// Check for .skip in URI
-    char *skip_ptr = strstr(uri, ".skip");
-    if (skip_ptr != NULL) {
-        skip_invoked = 1;
-        // Remove ".skip" from URI
-        memmove(skip_ptr, skip_ptr + SKIP_BYTES, strlen(skip_ptr + SKIP_BYTES) + 1); 
-    }
-	printf("%s %s %s\n", method, uri, version);
-
-
-	if (strcasecmp(method, "GET") && strcasecmp(method, "REAL")) {
-		requestError(fd, method, "501", "Not Implemented", "OS-HW3 Server does not implement this method", arrival, dispatch, t_stats);
-		return skip_invoked;
+	if (strcasecmp(req->method, "GET") && strcasecmp(req->method, "REAL")) {
+		requestError(conn, req->method, "501", "Not Implemented", "OS-HW3 Server does not implement this method", arrival, dispatch, t_stats);
+		return req->skip;
 	}
 
-	requestReadhdrs(&rio);
-
-	is_static = requestParseURI(uri, filename, cgiargs);
-	if (stat(filename, &sbuf) < 0) {
-		requestError(fd, filename, "404", "Not found", "OS-HW3 Server could not find this file", arrival, dispatch, t_stats);
-		return skip_invoked;
+	requestReadhdrs(&conn->rio, req);
+	if (keepalive_timeout_ms && conn->requests < keepalive_max) {
+		// HTTP/1.1 is persistent unless asked otherwise, HTTP/1.0 only when asked
+		conn->keep_alive = !strcasecmp(req->version, "HTTP/1.1") ? req->persistent != 0 : req->persistent == 1;
+	}
+	metricsPhase(PHASE_PARSE);
+
+	if (req->is_static && static_cache) {
+		cache_entry entry = cacheGet(static_cache, req->filename);
+		if (entry) {
+			metricsPhase(PHASE_OPEN);
+			(t_stats->stat_req)++;
+			requestServeCached(conn, entry, arrival, dispatch, t_stats);
+			cacheRelease(static_cache, entry);
+			return req->skip;
+		}
+		// not cacheable, go the usual way (and report 404/403 from there)
+	}
+	if (stat(req->filename, &sbuf) < 0) {
+		requestError(conn, req->filename, "404", "Not found", "OS-HW3 Server could not find this file", arrival, dispatch, t_stats);
+		return req->skip;
 	}
 	
-	if (is_static) {
+	if (req->is_static) {
 		if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-			requestError(fd, filename, "403", "Forbidden", "OS-HW3 Server could not read this file", arrival, dispatch, t_stats);
-			return skip_invoked;
+			requestError(conn, req->filename, "403", "Forbidden", "OS-HW3 Server could not read this file", arrival, dispatch, t_stats);
+			return req->skip;
 		}
 		(t_stats->stat_req)++;
-		requestServeStatic(fd, filename, sbuf.st_size, arrival, dispatch, t_stats);
+		requestServeStatic(conn, req->filename, sbuf.st_size, arrival, dispatch, t_stats);
 	} else {
 		if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-			requestError(fd, filename, "403", "Forbidden", "OS-HW3 Server could not run this CGI program", arrival, dispatch, t_stats);
-			return skip_invoked;
+			requestError(conn, req->filename, "403", "Forbidden", "OS-HW3 Server could not run this CGI program", arrival, dispatch, t_stats);
+			return req->skip;
 		}
+		metricsPhase(PHASE_OPEN);
 		(t_stats->dynm_req)++;
-		requestServeDynamic(fd, filename, cgiargs, arrival, dispatch, t_stats);
+		// the CGI program writes the rest of the response, we cannot tell where it ends
+		conn->keep_alive = 0;
+		requestServeDynamic(conn->fd, req->filename, req->cgiargs, arrival, dispatch, t_stats);
+		metricsPhase(PHASE_CGI);
 	}
 
+	return req->skip;
+}
+
+// handle a request, timing its phases
+int requestHandle(connection conn, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
+{
+	metricsPhaseStart(conn->arrival_ns);
+	metricsPhase(PHASE_QUEUE);
+	int skip_invoked = requestRespond(conn, arrival, dispatch, t_stats);
+	metricsRecord(PHASE_TOTAL, metricsNow() - conn->arrival_ns);
 	return skip_invoked;
 }
\ No newline at end of file
@@ -1,8 +1,25 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include "segel.h"
+#include "cache.h"
+#include "cgipool.h"
+#include "flight.h"
+#include "metrics.h"
+
 #define SKIP_BYTES 5
 
+// how requestServeStatic moves file bytes to the socket
+#define STATIC_SENDFILE 0  // sendfile from the page cache, mmap where unavailable
+#define STATIC_MMAP 1      // mmap the file and write it through user space
+
+extern int static_send_mode;
+
+// static files are served from here when set, NULL disables caching
+extern Cache static_cache;
+extern CgiPool cgi_pool; // NULL: fork and exec for every dynamic request
+extern Flight cgi_flights; // identical dynamic requests share one run of the program, NULL: each runs it
+
 typedef struct Threads_stats{
 	int id;
 	int stat_req;
@@ -10,10 +27,57 @@ typedef struct Threads_stats{
 	int total_req;
 } * threads_stats;
 
+// Fills in the filetype given the filename
+void requestGetFiletype(char *filename, char *filetype);
+
+// a request, parsed once by the acceptor when its request line arrives
+typedef struct Http_request{
+	char method[16], version[16];   // longer ones are cut, they cannot match anyway
+	char uri[MAXLINE];               // as sent, without ".skip"
+	char filename[MAXLINE], cgiargs[MAXLINE];
+	int is_static;
+	int is_real;                     // REAL: vip, or class 0
+	int skip;                        // the uri had ".skip"
+	long est;                        // deadline in ms after arrival, 0 if none
+	int priority;                    // "Priority: <n>" header, -1 if none
+	int persistent;                  // "Connection:" header: 1 keep-alive, 0 close, -1 not given
+	int headers_done;                // all header lines were read, else the worker reads the rest
+} * http_request;
+
+// a client connection, kept across requests when keep-alive is on
+typedef struct Connection{
+	int fd;
+	rio_t rio;               // survives between requests, may already hold the next (pipelined) one
+	struct Http_request request;   // the request waiting to be handled
+	struct timeval arrival;  // of the request waiting to be handled
+	long arrival_ns;         // the same on CLOCK_MONOTONIC, for the latency histograms
+	int requests;            // requests handled on this connection so far
+	int keep_alive;          // set by requestHandle: give it back to the acceptor instead of closing it
+
+	// acceptor bookkeeping
+	long deadline;           // closed if still idle at this time (ms, CLOCK_MONOTONIC)
+	int acceptor;            // the acceptor thread it came in through, it goes back there
+	struct Connection *prev, *next;
+} * connection;
+
+// keep-alive settings, keepalive_timeout_ms == 0 closes every connection after one request
+extern int keepalive_timeout_ms;
+extern int keepalive_max;
+
 // handle a request
-int requestHandle(int fd, struct timeval arrival, struct timeval dispatch, threads_stats t_stats);
+int requestHandle(connection conn, struct timeval arrival, struct timeval dispatch, threads_stats t_stats);
+
+//  Returns 1 once the request line can be read without blocking, 0 if not yet, -1 on EOF/error
+int requestLineReady(connection conn);
+
+// parse the request whose line is ready into conn->request, never blocks:
+// header lines that have not arrived yet are left to the worker
+void requestParse(connection conn);
+
+//  Returns True/False if the parsed request is a GET of path (the metrics endpoint)
+int requestIsMetrics(connection conn, const char *path);
 
-//  Returns True/False if realtime event
-int getRequestMetaData(int fd);
+// answer a metrics request without queueing it, on a thread that closes the connection after
+void requestServeMetrics(connection conn);
 
 #endif
@@ -0,0 +1,83 @@
+#!/bin/bash
+# Overload-policy benchmark: starts the server for every threads/queue/policy
+# combination, drives it with ./client at increasing offered load and writes
+# one CSV row per run.
+#
+#   ./run_bench.sh [output.csv]        (default tests_output/bench.csv)
+#
+# The matrix and the traffic can be changed through the environment, e.g.
+#   POLICIES="dt random" RATES="100 400" DURATION=3 ./run_bench.sh
+#
+# To compare pinned and unpinned runs, list CPU lists for the workers in PINS
+# ("off" leaves them unpinned), e.g. PINS="off 0-7 node0,node1" ./run_bench.sh
+# The acceptor can be pinned as well through SERVER_OPTIONS="--pin-acceptors=...".
+#
+# Runs are reproducible: the client uses a fixed seed for the arrivals, the URI
+# mix and the REAL share. Remember that output.cgi spins for 10 seconds, so even
+# a small CGI share overloads a few threads.
+
+THREADS=${THREADS:-"2 8"}
+QUEUES=${QUEUES:-"8 32"}
+POLICIES=${POLICIES:-"block dt dh bf random"}
+RATES=${RATES:-"50 200 800"}
+DURATION=${DURATION:-5}
+CONNECTIONS=${CONNECTIONS:-64}
+REAL=${REAL:-0.05}
+TIMEOUT_MS=${TIMEOUT_MS:-30000}
+SEED=${SEED:-1}
+SERVER_OPTIONS=${SERVER_OPTIONS:-"--log=off"}
+PINS=${PINS:-off}
+OUT=${1:-tests_output/bench.csv}
+
+cd "$(dirname "$0")"
+make -s || exit 1
+
+MIX=$(mktemp)
+trap 'rm -f "$MIX"' EXIT
+cat > "$MIX" <<EOF
+/home.html 97
+/favicon.ico 2
+/output.cgi?1 1
+EOF
+
+# field of the client's JSON report: top level number
+field() {
+    grep "\"$2\":" <<< "$1" | head -1 | sed -E 's/.*: ([0-9.]+).*/\1/'
+}
+
+# percentile of one class (all, get, real) of a latency section
+percentile() {
+    grep "\"$2\":" <<< "$1" | sed -E "s/.*\"$3\": \{[^}]*\"$4\": ([0-9.]+).*/\1/"
+}
+
+echo "policy,threads,queue_size,pin,offered_rps,sent,unsent,ok,dropped,timeouts,goodput_rps,drop_rate,p50_ms,p99_ms,vip_p99_ms,queue_wait_p99_ms" > "$OUT"
+for policy in $POLICIES; do
+    for threads in $THREADS; do
+        for queue in $QUEUES; do
+          for pin in $PINS; do
+            pinning=""
+            [ "$pin" != off ] && pinning="--pin-workers=$pin"
+            for rate in $RATES; do
+                port=$((20000 + RANDOM % 20000))
+                ./server $port $threads $queue $policy $SERVER_OPTIONS $pinning > /dev/null 2>&1 &
+                server=$!
+                sleep 0.3
+                report=$(./client localhost $port --connections=$CONNECTIONS --duration=$DURATION \
+                         --rate=$rate --uris="$MIX" --real=$REAL --timeout=$TIMEOUT_MS --seed=$SEED)
+                kill $server 2> /dev/null
+                wait $server 2> /dev/null
+
+                row="$policy,$threads,$queue,\"$pin\",$rate"
+                for name in sent unsent ok dropped timeouts goodput_rps drop_rate; do
+                    row="$row,$(field "$report" $name)"
+                done
+                row="$row,$(percentile "$report" latency_ms all p50)"
+                row="$row,$(percentile "$report" latency_ms all p99)"
+                row="$row,$(percentile "$report" latency_ms real p99)"
+                row="$row,$(percentile "$report" queue_wait_ms all p99)"
+                echo "$row" | tee -a "$OUT"
+            done
+          done
+        done
+    done
+done
@@ -1,5 +1,5 @@
 #!/bin/bash
-gcc -o test_queue tests.c queue.c -Wall
+gcc -o test_queue tests.c queue.c segel.c -Wall
 ./test_queue > tests_output/output_queue.txt
 
 # Remove arrival timestamps (assuming format: "Arrival: X.XXXXXX")
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* memmem, memrchr */
 #include "segel.h"
 
 /************************** 
@@ -169,6 +170,15 @@ void Fstat(int fd, struct stat *buf)
         unix_error("Fstat error");
 }
 
+int Fcntl(int fd, int cmd, int arg)
+{
+    int rc;
+
+    if ((rc = fcntl(fd, cmd, arg)) < 0)
+        unix_error("Fcntl error");
+    return rc;
+}
+
 /***************************************
  * Wrappers for memory mapping functions
  ***************************************/
@@ -187,6 +197,36 @@ void Munmap(void *start, size_t length)
         unix_error("munmap error");
 }
 
+/********************
+ * Epoll wrappers
+ ********************/
+int Epoll_create1(int flags)
+{
+    int rc;
+
+    if ((rc = epoll_create1(flags)) < 0)
+        unix_error("Epoll_create1 error");
+    return rc;
+}
+
+void Epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    if (epoll_ctl(epfd, op, fd, event) < 0)
+        unix_error("Epoll_ctl error");
+}
+
+int Epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    int rc;
+
+    if ((rc = epoll_wait(epfd, events, maxevents, timeout)) < 0) {
+        if (errno == EINTR) /* interrupted by sig handler return */
+            return 0;       /* caller simply waits again */
+        unix_error("Epoll_wait error");
+    }
+    return rc;
+}
+
 /**************************** 
  * Sockets interface wrappers
  ****************************/
@@ -318,6 +358,154 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_sendn - robustly send n bytes (unbuffered) with send() flags,
+ *    e.g. MSG_MORE to hold them back until the next write to the socket
+ */
+ssize_t rio_sendn(int fd, void *usrbuf, size_t n, int flags)
+{
+    size_t nleft = n;
+    ssize_t nsent;
+    char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        if ((nsent = send(fd, bufp, nleft, flags)) <= 0) {
+            if (errno == EINTR)  /* interrupted by sig handler return */
+                nsent = 0;       /* and call send() again */
+            else
+                return -1;       /* errorno set by send() */
+        }
+        nleft -= nsent;
+        bufp += nsent;
+    }
+    return n;
+}
+
+/*
+ * rio_writev - robustly write all iovcnt buffers (unbuffered) with as few
+ *    writev() calls as possible. iov is advanced past what was written.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t n = 0, nleft;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        n += iov[i].iov_len;
+    nleft = n;
+    while (nleft > 0) {
+        if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+            if (errno == EINTR)  /* interrupted by sig handler return */
+                nwritten = 0;    /* and call writev() again */
+            else
+                return -1;       /* errorno set by writev() */
+        }
+        nleft -= nwritten;
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) { /* skip what is done */
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return n;
+}
+
+/*
+ * rio_sendfile - robustly send n bytes of in_fd, starting at offset, to out_fd
+ *    without copying them through user space. Returns n, or -1 with errno set.
+ *    EINVAL/ENOSYS mean sendfile cannot be used for this pair of descriptors
+ *    and nothing was sent, so the caller can fall back to a plain write.
+ */
+ssize_t rio_sendfile(int out_fd, int in_fd, off_t offset, size_t n)
+{
+#ifdef __linux__
+    size_t nleft = n;
+    ssize_t nsent;
+
+    while (nleft > 0) {
+        if ((nsent = sendfile(out_fd, in_fd, &offset, nleft)) <= 0) {
+            if (nsent < 0 && errno == EINTR) /* interrupted by sig handler return */
+                continue;                    /* and call sendfile() again */
+            if (nsent == 0)                  /* file shrank under us */
+                errno = EIO;
+            return -1;
+        }
+        nleft -= nsent;
+    }
+    return n;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * send_fd - send one message of n bytes over the Unix domain socket sock,
+ *    with a copy of descriptor fd attached to it. Returns n or -1.
+ */
+ssize_t send_fd(int sock, int fd, void *usrbuf, size_t n)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    ssize_t nsent;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = usrbuf;
+    iov.iov_len = n;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while ((nsent = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return nsent;
+}
+
+/*
+ * recv_fd - receive one message of at most n bytes from the Unix domain
+ *    socket sock. *fd is set to the descriptor attached to it, or -1 if none.
+ *    Returns the number of bytes received, 0 on EOF, -1 on error.
+ */
+ssize_t recv_fd(int sock, int *fd, void *usrbuf, size_t n)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    ssize_t nread;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = usrbuf;
+    iov.iov_len = n;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    while ((nread = recvmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    for (cmsg = CMSG_FIRSTHDR(&msg); nread >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return nread;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -394,30 +582,144 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_fill - move the unread bytes to the front of the internal buffer
+ *    and read more after them, without waiting if nonblocking is set.
+ *    Returns the number of new bytes, 0 on EOF or when the buffer is full,
+ *    -1 on error. Invalidates earlier views.
+ */
+static ssize_t rio_fill(rio_t *rp, int nonblocking)
+{
+    ssize_t nread;
+
+    if (rp->rio_bufptr != rp->rio_buf) {
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == sizeof(rp->rio_buf))
+        return 0;
+    size_t room = sizeof(rp->rio_buf) - rp->rio_cnt;
+    while ((nread = nonblocking ? recv(rp->rio_fd, rp->rio_buf + rp->rio_cnt, room, MSG_DONTWAIT)
+                                : read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, room)) < 0) {
+        if (errno != EINTR) /* interrupted by sig handler return */
+            return -1;
+    }
+    rp->rio_cnt += nread;
+    return nread;
+}
+
+/*
+ * rio_fillnb - add what the socket already holds to the internal buffer,
+ *    never blocks. Returns the number of new bytes, 0 on EOF or when the
+ *    buffer is full, -1 on error (EAGAIN: nothing has arrived).
+ */
+ssize_t rio_fillnb(rio_t *rp)
+{
+    return rio_fill(rp, 1);
+}
+
+/*
+ * rio_consume - hand out the next n buffered bytes as a view
+ */
+static ssize_t rio_consume(rio_t *rp, rio_view_t *view, size_t n)
+{
+    view->data = rp->rio_bufptr;
+    view->len = n;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+
+/*
+ * rio_readlinev - read a text line of at most maxlen bytes (buffered)
+ *    without copying it: *line points into the internal buffer and stays
+ *    valid until the next read on rp. The buffer is searched with memchr
+ *    instead of byte by byte. Returns the line length, 0 on EOF, -1 on error.
+ */
+ssize_t rio_readlinev(rio_t *rp, rio_view_t *line, size_t maxlen)
+{
+    size_t scanned = 0;
+    ssize_t nread;
+    char *nl;
+
+    if (maxlen > sizeof(rp->rio_buf))
+        maxlen = sizeof(rp->rio_buf);
+    while (1) {
+        size_t avail = (size_t)rp->rio_cnt < maxlen ? (size_t)rp->rio_cnt : maxlen;
+        if ((nl = memchr(rp->rio_bufptr + scanned, '\n', avail - scanned)) != NULL)
+            return rio_consume(rp, line, nl + 1 - rp->rio_bufptr);
+        if (avail == maxlen)
+            return rio_consume(rp, line, maxlen); /* too long, hand out the first part */
+        scanned = avail;
+        if ((nread = rio_fill(rp, 0)) < 0)
+            return -1;
+        if (nread == 0)   /* EOF, with or without a last unterminated line */
+            return rio_consume(rp, line, rp->rio_cnt);
+    }
+}
+
+/*
+ * rio_head - the complete header lines, up to the empty line, already in
+ *    the buffer. Reads more only if block is set.
+ */
+static ssize_t rio_head(rio_t *rp, rio_view_t *head, int block)
+{
+    ssize_t nread;
+    char *end, *nl;
+
+    while (1) {
+        if (rp->rio_cnt >= 2 && rp->rio_bufptr[0] == '\r' && rp->rio_bufptr[1] == '\n')
+            return rio_consume(rp, head, 2); /* no (more) headers */
+        if ((end = memmem(rp->rio_bufptr, rp->rio_cnt, "\n\r\n", 3)) != NULL)
+            return rio_consume(rp, head, end + 3 - rp->rio_bufptr);
+        if (!block || rp->rio_cnt == sizeof(rp->rio_buf)) { /* hand out the complete lines */
+            if ((nl = memrchr(rp->rio_bufptr, '\n', rp->rio_cnt)) != NULL)
+                return rio_consume(rp, head, nl + 1 - rp->rio_bufptr);
+            return block ? rio_consume(rp, head, rp->rio_cnt) : 0;
+        }
+        if ((nread = rio_fill(rp, 0)) < 0)
+            return -1;
+        if (nread == 0)   /* EOF before the empty line */
+            return rio_consume(rp, head, rp->rio_cnt);
+    }
+}
+
+/*
+ * rio_readheadv - read the header lines of an HTTP message, up to and
+ *    including the empty line that ends them, as one view (buffered).
+ *    The buffer is searched for "\n\r\n" with memmem. If the headers do not
+ *    fit in the buffer, the complete lines that do are returned and the
+ *    caller calls again; only the last call's view ends with the empty line.
+ *    Returns the view length, 0 on EOF, -1 on error.
+ */
+ssize_t rio_readheadv(rio_t *rp, rio_view_t *head)
+{
+    return rio_head(rp, head, 1);
+}
+
+/*
+ * rio_readheadvnb - like rio_readheadv, but only over what is already
+ *    buffered: returns 0 instead of reading when no complete line is there.
+ */
+ssize_t rio_readheadvnb(rio_t *rp, rio_view_t *head)
+{
+    return rio_head(rp, head, 0);
+}
+
 /* 
  * rio_readlineb - robustly read a text line (buffered)
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
-            return -1;    /* error */
-    }
-    *bufp = 0;
-    return n;
+    rio_view_t line;
+    ssize_t n;
+
+    if ((n = rio_readlinev(rp, &line, maxlen - 1)) < 0)
+        return -1;    /* error */
+    memcpy(usrbuf, line.data, n);
+    ((char *)usrbuf)[n] = 0;
+    return n;         /* 0 on EOF, no data read */
 }
 /* $end rio_readlineb */
 
@@ -439,6 +741,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
         unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+        unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -462,6 +770,24 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_readlinev(rio_t *rp, rio_view_t *line, size_t maxlen)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readlinev(rp, line, maxlen)) < 0)
+        unix_error("Rio_readlinev error");
+    return rc;
+}
+
+ssize_t Rio_readheadv(rio_t *rp, rio_view_t *head)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readheadv(rp, head)) < 0)
+        unix_error("Rio_readheadv error");
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -474,13 +800,9 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, int port) 
 {
-    int clientfd;
     struct hostent *hp;
     struct sockaddr_in serveraddr;
 
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        return -1; /* check errno for cause of error */
-
     /* Fill in the server's IP address and port */
     if ((hp = gethostbyname(hostname)) == NULL)
         return -2; /* check h_errno for cause of error */
@@ -490,19 +812,40 @@ int open_clientfd(char *hostname, int port)
           (char *)&serveraddr.sin_addr.s_addr, hp->h_length);
     serveraddr.sin_port = htons(port);
 
+    return open_clientaddr(&serveraddr);
+}
+/* $end open_clientfd */
+
+/*
+ * open_clientaddr - open connection to an address resolved beforehand.
+ *   Unlike open_clientfd, safe to call from many threads at once.
+ *   Returns -1 and sets errno on Unix error.
+ */
+int open_clientaddr(struct sockaddr_in *serveraddr)
+{
+    int clientfd;
+
+    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1; /* check errno for cause of error */
+
     /* Establish a connection with the server */
-    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0)
+    if (connect(clientfd, (SA *) serveraddr, sizeof(*serveraddr)) < 0) {
+        int saved = errno;
+        close(clientfd);
+        errno = saved;
         return -1;
+    }
     return clientfd;
 }
-/* $end open_clientfd */
 
 /*  
  * open_listenfd - open and return a listening socket on port
+ *     With reuseport, several sockets may listen on the same port and the
+ *     kernel spreads the new connections over them (SO_REUSEPORT).
  *     Returns -1 and sets errno on Unix error.
  */
 /* $begin open_listenfd */
-int open_listenfd(int port) 
+int open_listenfd(int port, int reuseport) 
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -519,6 +862,11 @@ int open_listenfd(int port)
       fprintf(stderr, "setsockopt failed\n");
       return -1;
     }
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                (const void *)&optval , sizeof(int)) < 0) {
+      fprintf(stderr, "setsockopt failed\n");
+      return -1;
+    }
 
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
@@ -556,11 +904,11 @@ int Open_clientfd(char *hostname, int port)
     return rc;
 }
 
-int Open_listenfd(int port) 
+int Open_listenfd(int port, int reuseport) 
 {
     int rc;
 
-    if ((rc = open_listenfd(port)) < 0)
+    if ((rc = open_listenfd(port, reuseport)) < 0)
         unix_error("Open_listenfd error");
     return rc;
 }
@@ -23,6 +23,11 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -47,6 +52,12 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* A run of bytes inside a rio_t buffer, not NUL-terminated. Valid until the next read on that rio_t */
+typedef struct {
+    char *data;
+    size_t len;
+} rio_view_t;
+
 /* External variables */
 extern int h_errno;    /* defined by BIND for DNS errors */ 
 extern char **environ; /* defined by libc */
@@ -83,11 +94,17 @@ int Select(int  n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
 int Dup2(int fd1, int fd2);
 void Stat(const char *filename, struct stat *buf);
 void Fstat(int fd, struct stat *buf) ;
+int Fcntl(int fd, int cmd, int arg);
 
 /* Memory mapping wrappers */
 void *Mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
 void Munmap(void *start, size_t length);
 
+/* Epoll wrappers */
+int Epoll_create1(int flags);
+void Epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int Epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
 /* Sockets interface wrappers */
 int Socket(int domain, int type, int protocol);
 void Setsockopt(int s, int level, int optname, const void *optval, int optlen);
@@ -103,23 +120,38 @@ struct hostent *Gethostbyaddr(const char *addr, int len, int type);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_sendn(int fd, void *usrbuf, size_t n, int flags);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_readlinev(rio_t *rp, rio_view_t *line, size_t maxlen);
+ssize_t rio_readheadv(rio_t *rp, rio_view_t *head);
+ssize_t rio_readheadvnb(rio_t *rp, rio_view_t *head);
+ssize_t rio_fillnb(rio_t *rp);
+ssize_t rio_sendfile(int out_fd, int in_fd, off_t offset, size_t n);
+
+/* Descriptor passing over Unix domain sockets */
+ssize_t send_fd(int sock, int fd, void *usrbuf, size_t n);
+ssize_t recv_fd(int sock, int *fd, void *usrbuf, size_t n);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_readlinev(rio_t *rp, rio_view_t *line, size_t maxlen);
+ssize_t Rio_readheadv(rio_t *rp, rio_view_t *head);
 
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
-int open_listenfd(int portno);
+int open_clientaddr(struct sockaddr_in *serveraddr);
+int open_listenfd(int portno, int reuseport);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
-int Open_listenfd(int port); 
+int Open_listenfd(int port, int reuseport); 
 
 #endif /* __CSAPP_H__ */
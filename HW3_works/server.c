@@ -1,183 +1,691 @@
 #include "segel.h"
 #include "request.h"
 #include "queue.h"
+#include "shards.h"
+#include "codel.h"
+#include "classes.h"
+#include "affinity.h"
+#include "uring.h"
+#include "log.h"
 #include "pthread.h"
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #define BUFFER 10
-#define NUM_OF_POLICIES 5
+#define NUM_OF_POLICIES 6
+#define MAX_EVENTS 64
 
 //
 // server.c: A very, very simple web server
 //
 // To run:
-//  ./server <portnum (above 2000)>
+//  ./server <portnum (above 2000)> <threads> <queue_size> <policy> [options]
+//
+// Policies for a full queue: block, dt (drop tail), dh (drop head), bf (block
+// flush), random (drop half). codel also drops from the head before the queue is
+// full, whenever requests keep waiting longer than a target delay (see codel.h).
+//
+// A regular request may carry a deadline, ms after its arrival, as an est=<ms>
+// query parameter or a "Deadline: <ms>" header. Those wait in a heap and are
+// served earliest deadline first, ahead of the untagged ones; a request whose
+// deadline passed while it waited is dropped instead of served. Ignored with --shards
+// and --classes.
+//
+// Options:
+//  --shards=rr|least   give every worker its own waiting queue, filled in turn (rr)
+//                      or least-loaded first; idle workers steal from their peers
+//  --static=sendfile|mmap
+//                      how static files reach the socket (default sendfile)
+//  --cache=<size>[K|M|G]
+//                      keep up to size bytes of static files in memory
+//  --cache-ttl=<ms>    how long a cached file is trusted before it is stat-ed again (default 1000)
+//  --keepalive=<ms>    keep connections open between requests, closing them after ms idle (default 0: off)
+//  --keepalive-max=<n> requests served on one connection before it is closed (default 100)
+//  --cgi-pool=<n>      keep up to n processes of every CGI program that supports loop mode
+//  --coalesce=<ms>     identical CGI requests (same program and query) that arrive while one
+//                      runs wait for it and get its output, which is also reused for ms after
+//                      (0: only by those that waited). Default: every request runs the program
+//  --metrics=<path>    answer GET <path> with live counters in the Prometheus text format,
+//                      straight from the master thread without queueing it. Includes
+//                      p50/p90/p99/p999 of every request phase (queue, parse, open, send, cgi)
+//  --classes=<weight>[/<threads>],...
+//                      priority classes instead of the single vip thread, the most important
+//                      first. Each has its own queue, a dispatch weight and optionally threads
+//                      of its own besides the shared workers. REAL requests go to class 0, a
+//                      "Priority: <n>" header picks class n, the rest go to the last class
+//  --class-dispatch=wfq|strict
+//                      how the shared workers pick a class: weighted fair (default) or the
+//                      most important first
+//  --class-aging=<ms>  strict: a request moves up one class for every ms it waited (default 0: never)
+//  --codel-target=<ms> queueing delay codel tolerates (default 5)
+//  --codel-interval=<ms>
+//                      how long the delay may stay above target before codel drops (default 100)
+//  --log=off|error|info|debug
+//                      what goes to stdout, written by a background thread (default debug)
+//  --threads-max=<n>   elastic pool: up to n shared workers, never fewer than <threads>.
+//                      One more is started when requests have been waiting with every
+//                      worker busy for --scale-wait ms (default 50), or as soon as
+//                      --scale-depth of them are waiting (default 0: depth is not used).
+//                      The extra ones stop after --scale-cooldown ms idle (default 5000)
+//  --pin-workers=<list>, --pin-vip=<list>, --pin-acceptors=<list>
+//                      pin those threads to CPUs: thread i to entry i of the list, in turn.
+//                      Entries are CPUs, ranges of CPUs and NUMA nodes, e.g. 0-3,8 or
+//                      node0,node1 (see affinity.h). Default: not pinned
+//  --acceptors=<k>     k acceptor threads, each with a listening socket of its own on the
+//                      port (SO_REUSEPORT) so the kernel spreads new connections over them.
+//                      They all admit into the same queues (default 1)
 //
 // Repeatedly handles HTTP requests sent to this port number.
 // Most of the work is done within routines written in request.c
 //
-int DEBUG = 1;
+int log_option = LOG_DEBUG; // --log
+
+// an acceptor thread: its listening socket, and the connections waiting in its epoll
+typedef struct Acceptor{
+    int id;
+    int listenfd, epfd;
+    connection idle_head, idle_tail; // kept-alive connections waiting in epoll, oldest deadline first. this acceptor only
+    connection returned_conns;       // kept-alive connections handed back by the workers, guarded by returned_lock
+    pthread_mutex_t returned_lock;
+    int returned_efd;                // the workers wake the acceptor through it
+    Uring accept_ring, recv_ring;    // the io_uring engine (uring.h), NULL when it is not used
+    int reserve_fd;                  // kept open to be closed for acceptShed, -1 if it could not be reopened
+    int shed;                        // connections turned away since shed_logged_ms
+    int accept_paused;               // the ring's accept stopped out of descriptors, listenfd is polled until accept() works
+    long shed_logged_ms;
+    pthread_t thread;
+} * acceptor;
 
 // DECLERATIONS
+void acceptLoop(acceptor a);
+void *acceptorThread(void *arg);
+connection connectionOpen(acceptor a, int connfd);
+void connectionAccepted(acceptor a, int connfd);
+int acceptShed(acceptor a, int err);
+void connectionFinish(connection conn);
+void connectionPoll(acceptor a, connection conn);
+void idleAppend(acceptor a, connection conn);
+void idleRemove(acceptor a, connection conn);
+int idleTimeout(acceptor a);
+long monotonicMs();
+void connectionArrived(connection conn);
+void admitRequest(int connfd, struct timeval arrival);
 void initMaster(int threads_num, int queue_size, pthread_t *worker_threads, pthread_t *vip_thread);
 void *workerThread(void *thread_number);
 void *vipThread(void *thread_number);
+void *poolThread(void *arg);
+void poolSpawn();
+int poolExtra(int id);
 void getargs(int *port, int *threads_num, int *queue_size, char *policy, int argc, char *argv[]);
+void getoptions(int argc, char *argv[]);
+long parseSize(char *value);
+int parseClasses(char *value);
 int totalReqInQueue();
+int waitingSize();
+void waitingPush(int connfd, struct timeval arrival, long deadline, int cls);
+int waitingTake(int only, struct timeval *arrival, long *deadline);
+int waitingReady(int only);
+int waitingDropHead();
+int waitingDropTail();
+int waitingDropRandom(int *victims);
+void publishStats(thread_metrics metrics, threads_stats t_stats);
+int waitingTakeNewest(struct timeval *arrival);
+void waitForRoom();
+void requestDone(int connfd);
 int isValidPolicy(char *policy);
+int threadCreate(pthread_t *thread, Affinity pin, int index, void *(*start)(void *), void *arg);
 
 // GLOBALS
-Queue handeling_requests, waiting_requests, vip_waiting_requests;
+Queue waiting_requests, vip_waiting_requests;
+Heap deadline_requests; // regular requests with a deadline, earliest first. not used with shards
+Inflight handeling_requests;
+Shards shards;       // per-worker waiting queues, NULL unless --shards was given
+int shard_placement;
+int sharded_total;   // regular requests waiting in the shards or being handled, guarded by lock
+long cache_size;     // 0 unless --cache was given
+int cache_ttl_ms = 1000;
+int cgi_pool_size;   // 0 unless --cgi-pool was given
+int coalesce_ttl_ms = -1; // -1 unless --coalesce was given
+char *metrics_path;  // NULL unless --metrics was given
+Codel *codels;       // per worker, NULL unless the policy is codel. Shared by all workers unless sharded
+int codel_target_ms = CODEL_TARGET_MS;
+int codel_interval_ms = CODEL_INTERVAL_MS;
+Classes classes;     // NULL unless --classes was given, then it replaces the vip queue and thread
+int class_count;
+int class_weights[CLASSES_MAX], class_threads[CLASSES_MAX];
+int class_dispatch = CLASSES_WFQ;
+int class_aging_ms;
+int *thread_class;   // class served only by each thread, -1 for the shared workers
+pthread_cond_t class_allowed[CLASSES_MAX];
+int pool_max;              // --threads-max, 0 unless the worker pool is elastic
+int pool_scale_wait_ms = 50;
+int pool_scale_depth;
+int pool_cooldown_ms = 5000;
+int pool_base;             // id of the first extra worker, after the vip thread's
+int pool_extra;            // extra worker ids: pool_base .. pool_base + pool_extra - 1
+int pool_live;             // shared workers running, guarded by lock
+int pool_idle;             // shared workers waiting for a request, guarded by lock
+char *pool_running;        // per extra id: has a thread, guarded by lock
+threads_stats *pool_stats; // per extra id, kept when its thread stops so Stat-Thread-* carry on
+__thread thread_metrics master_metrics; // the calling acceptor's own
+__thread int *random_victims;           // the calling acceptor's, for the requests policy random drops
+connection *connections; // indexed by descriptor, a slot is reused by the next connection on that fd
+int max_connections;
+struct Acceptor *acceptors;
+int acceptors_num = 1;
+Affinity pin_workers, pin_vip, pin_acceptors; // NULL: not pinned
 pthread_mutex_t lock;
 pthread_cond_t new_req_allowed, vip_allowed, worker_allowed, empty_queue, full_queue;
 int queue_size;
 int handeling_vip;
-const char *common_policies[] = {"block", "dh", "dt", "bf", "random"};
-struct timeval initt; // STARTED TO BE DELETED
+char policy[BUFFER];
+const char *common_policies[] = {"block", "dh", "dt", "bf", "random", "codel"};
 
 int main(int argc, char *argv[])
 {
-    int listenfd, connfd, port, clientlen, threads_num, is_vip;
-    char policy[BUFFER];
-    struct sockaddr_in clientaddr;
-    struct timeval arrival, started; // STARTED TO BE DELETED
-    gettimeofday(&initt, NULL); // DELTEEEEE
-
+    int port, threads_num;
 
     getargs(&port, &threads_num, &queue_size, policy, argc, argv);
+    logInit(log_option, STDOUT_FILENO);
+    // a client that closes early must not kill the server while it sends; the send fails with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
     pthread_t *worker_threads = malloc(sizeof(pthread_t) * threads_num);
     pthread_t vip_thread;
     initMaster(threads_num, queue_size, worker_threads, &vip_thread);
 
-    // start listening
-    listenfd = Open_listenfd(port);
-
-    while (1)
+    // start listening, on one socket per acceptor
+    for (int a = 0; a < acceptors_num; a++)
     {
-        clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
+        acceptors[a].listenfd = Open_listenfd(port, acceptors_num > 1);
+    }
+    for (int a = 1; a < acceptors_num; a++)
+    {
+        threadCreate(&acceptors[a].thread, pin_acceptors, a, acceptorThread, &acceptors[a]);
+    }
 
-        pthread_mutex_lock(&lock); // -------------------------------->
+    acceptLoop(&acceptors[0]);
+}
 
-        gettimeofday(&arrival, NULL);
-        is_vip = getRequestMetaData(connfd); // check if regular or vip
-        if (DEBUG)
-        {
-            printf("[main] : recieved a task at: %ld, number:%d\n", arrival.tv_sec-initt.tv_sec, connfd);
-        }
+// The master thread never blocks on a single client socket:
+// new connections are registered in epoll and only admitted to the queues
+// once their request line can be read in full.
+// With keep-alive the workers hand finished connections back here, and they
+// wait in epoll for their next request or until they were idle too long.
+// Every acceptor runs this loop on its own socket, the main thread included.
+void acceptLoop(acceptor a)
+{
+    int epfd, nready, connfd, clientlen, i, filled, listenfd = a->listenfd;
+    struct sockaddr_in clientaddr;
+    struct epoll_event ev, events[MAX_EVENTS];
+    rio_t *fill[MAX_EVENTS];
+    connection conn;
+    uint64_t wakeups;
+
+    if (pin_acceptors && a->id == 0 && affinityApply(pin_acceptors, 0) != 0)
+    { // the main thread, pinned only now: the threads it started would have inherited it
+        logError("could not pin acceptor 0, it runs unpinned");
+    }
+    master_metrics = metricsSelf(-1);
+    if ((random_victims = (int *)malloc(queue_size * sizeof(int))) == NULL)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    a->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    epfd = a->epfd = Epoll_create1(0);
+    Fcntl(listenfd, F_SETFL, Fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    a->accept_ring = uringCreate(MAX_EVENTS);
+    if (a->accept_ring != NULL && uringAcceptMultishot(a->accept_ring, listenfd) == 0)
+    { // epoll watches the ring, the connections come out of its completion queue
+        ev.data.fd = uringFd(a->accept_ring);
+    }
+    a->recv_ring = uringCreate(MAX_EVENTS);
+    Epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    ev.data.fd = a->returned_efd;
+    Epoll_ctl(epfd, EPOLL_CTL_ADD, a->returned_efd, &ev);
 
-        // proccess full queue according to policy
-        if (totalReqInQueue() >= queue_size)
+    while (1)
+    {
+        nready = Epoll_wait(epfd, events, MAX_EVENTS, idleTimeout(a));
+        if (a->recv_ring != NULL)
+        { // read all the client sockets of this round in one submission
+            for (i = filled = 0; i < nready; i++)
+            {
+                connfd = events[i].data.fd;
+                if (connfd != listenfd && connfd != a->returned_efd && connfd < max_connections && connections[connfd] != NULL &&
+                    (a->accept_ring == NULL || connfd != uringFd(a->accept_ring)))
+                {
+                    fill[filled++] = &connections[connfd]->rio;
+                }
+            }
+            uringFill(a->recv_ring, fill, filled);
+        }
+        for (i = 0; i < nready; i++)
         {
-            // if the waiting list is empty or block, then block as usual
-            if (queueSize(waiting_requests) == 0 || strcmp(policy, "block") == 0)
-            { // as it wassssssss
-                while (totalReqInQueue() >= queue_size)
-                { // waiting for place in wait queue
-                    if (DEBUG)
+            if (events[i].data.fd == listenfd)
+            { // listening socket: drain every pending connection
+                while (1)
+                {
+                    clientlen = sizeof(clientaddr);
+                    connfd = accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
+                    if (connfd < 0)
                     {
-                    gettimeofday(&started, NULL);
-                    printf("[master] : cond waiting at:%ld\n", started.tv_sec-initt.tv_sec) ;
+                        if (errno == ECONNABORTED || errno == EINTR ||
+                            ((errno == EMFILE || errno == ENFILE) && acceptShed(a, errno) == 0))
+                        {
+                            continue;
+                        }
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EMFILE && errno != ENFILE)
+                        { // out of descriptors was logged by acceptShed
+                            perror("accept");
+                        }
+                        break;
                     }
-                    pthread_cond_wait(&new_req_allowed, &lock);
-                    if (DEBUG)
-                    {
-                    gettimeofday(&started, NULL);
-                    printf("[master] : return from cond waiting at:%ld\n", started.tv_sec-initt.tv_sec);
+                    connectionAccepted(a, connfd);
+                    if (a->accept_paused && uringAcceptMultishot(a->accept_ring, listenfd) == 0)
+                    { // descriptors are free again, back to the ring
+                        a->accept_paused = 0;
+                        Epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL);
+                        ev.events = EPOLLIN;
+                        ev.data.fd = uringFd(a->accept_ring);
+                        Epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+                        break;
                     }
                 }
+                continue;
             }
-            else if (strcmp(policy, "dt") == 0)
-            { // drop tail - brand new request recieved
-                if (!is_vip)
-                {                                // req is regular - current is considered tail
-                    Close(connfd);               // after empty drop worker hoe req
-                    pthread_mutex_unlock(&lock); // ------------------------------^
-                    continue;
+
+            if (a->accept_ring != NULL && events[i].data.fd == uringFd(a->accept_ring))
+            { // multishot accept: take every connection it completed
+                while ((connfd = uringAccepted(a->accept_ring)) >= 0)
+                {
+                    connectionAccepted(a, connfd);
                 }
-                else
-                {                                                     // req is vip - remove from regular
-                    int fd_to_delete = dequeueTail(waiting_requests); // try to dequeue from waiting
-                    if (fd_to_delete != -1)
-                    { // should always succeed since the waiting should not be empty here
-                        if (DEBUG)
-                        {
-                            gettimeofday(&started, NULL);
-                            printf("[master] dt policy! QueueSize=%d, dropped %d at:%ld\n",totalReqInQueue()+1,fd_to_delete ,started.tv_sec-initt.tv_sec);
-                        }
-                        Close(fd_to_delete);
-                    }
+                if (errno == EINVAL)
+                { // no multishot accept on this kernel
+                    logError("io_uring accept is not supported, using accept()");
+                    Epoll_ctl(epfd, EPOLL_CTL_DEL, uringFd(a->accept_ring), NULL);
+                    a->accept_ring = NULL;
+                    ev.events = EPOLLIN;
+                    ev.data.fd = listenfd;
+                    Epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
                 }
-            }
-            else if (strcmp(policy, "dh") == 0)
-            { // drop head - brand old request recieved
-                int fd_to_delete = dequeue(waiting_requests);
-                if (fd_to_delete != -1)
-                {                        // check if queue is not empty
-                    Close(fd_to_delete); // should always succeed since waiting is not empty here
+                else if (errno == EMFILE || errno == ENFILE)
+                { // the ring's accept stopped: poll listenfd, and shed from there while it is readable
+                    acceptShed(a, errno);
+                    a->accept_paused = 1;
+                    Epoll_ctl(epfd, EPOLL_CTL_DEL, uringFd(a->accept_ring), NULL);
+                    ev.events = EPOLLIN;
+                    ev.data.fd = listenfd;
+                    Epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
                 }
-            }
-            else if (strcmp(policy, "bf") == 0)
-            {                                  // NOT A BUSY WAIT
-                while (totalReqInQueue() != 0) // use a brand new spanking conditional variable to wait till all queues are empty
-                {                              // waiting untill all the requests in the queues are handled
-                    if (DEBUG)
-                    {
-                    gettimeofday(&started, NULL);
-                    printf("[master] :block flush cond waiting at:%ld\n", started.tv_sec-initt.tv_sec);
-                    }
-                    pthread_cond_wait(&empty_queue, &lock);
-                    if (DEBUG)
-                    {
-                    gettimeofday(&started, NULL);
-                    printf("[master] : return from block flush cond waiting at:%ld\n", started.tv_sec-initt.tv_sec);
-                    }
+                else if (errno != EAGAIN && errno != ECONNABORTED)
+                {
+                    perror("accept");
                 }
-                if (!is_vip)
-                {                                // if req A is vip it shouldnt be dropped.
-                    Close(connfd);               // after empty drop worker hoe req
-                    pthread_mutex_unlock(&lock); // ------------------------------^
-                    continue;
+                continue;
+            }
+
+            if (events[i].data.fd == a->returned_efd)
+            { // workers gave connections back: admit the pipelined ones, wait for the rest
+                read(a->returned_efd, &wakeups, sizeof(wakeups));
+                pthread_mutex_lock(&a->returned_lock);
+                connection returned = a->returned_conns;
+                a->returned_conns = NULL;
+                pthread_mutex_unlock(&a->returned_lock);
+                while (returned != NULL)
+                {
+                    conn = returned;
+                    returned = returned->next;
+                    conn->next = NULL;
+                    connectionPoll(a, conn);
                 }
+                continue;
+            }
+
+            // client socket: wait until the request line is complete
+            conn = connections[events[i].data.fd];
+            int ready = requestLineReady(conn);
+            if (ready == 0)
+            {
+                continue;
+            }
+            Epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+            if (conn->deadline)
+            { // a kept-alive connection, its request arrives now
+                idleRemove(a, conn);
+                connectionArrived(conn);
             }
-            else if (strcmp(policy, "random") == 0)
-            {                                    // drop 50% of the waiting requests by random
-                randomDequeue(waiting_requests); // should always succeed since waiting is not empty here
+            if (ready < 0)
+            { // client went away before sending a request
+                Close(conn->fd);
+            }
+            else
+            {
+                admitRequest(conn->fd, conn->arrival);
             }
         }
 
-        // if we are here, there is place for new req:  assign the new req to proper queue
-        if (is_vip)
-        {                                                   // vip queue
-            enqueue(vip_waiting_requests, connfd, arrival); // insert new vip req
-            if (DEBUG)
-            {
-            gettimeofday(&started, NULL);
-            printf("[master] :adding new vip req. Queuesize=%d, TotalSize=%d\n", queueSize(vip_waiting_requests), totalReqInQueue());
+        // close the connections that stayed idle too long
+        while (a->idle_head != NULL && idleTimeout(a) == 0)
+        {
+            conn = a->idle_head;
+            idleRemove(a, conn);
+            Epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+            Close(conn->fd);
+        }
+    }
+}
+
+void *acceptorThread(void *arg)
+{
+    acceptLoop((acceptor)arg);
+    return NULL;
+}
+
+// prepare the connection slot of a newly accepted descriptor, NULL if it cannot be tracked
+connection connectionOpen(acceptor a, int connfd)
+{
+    if (connfd >= max_connections)
+    {
+        logError("descriptor %d above the connection table", connfd);
+        return NULL;
+    }
+    connection conn = connections[connfd];
+    if (conn == NULL)
+    {
+        conn = (connection)malloc(sizeof(struct Connection));
+        if (conn == NULL)
+        {
+            perror("malloc failed");
+            return NULL;
+        }
+        connections[connfd] = conn;
+    }
+    conn->fd = connfd;
+    Rio_readinitb(&conn->rio, connfd);
+    connectionArrived(conn);
+    conn->requests = 0;
+    conn->keep_alive = 0;
+    conn->deadline = 0;
+    conn->acceptor = a->id;
+    conn->prev = conn->next = NULL;
+    return conn;
+}
+
+// a new connection from either accept path: track it and wait in epoll for its request line
+void connectionAccepted(acceptor a, int connfd)
+{
+    struct epoll_event ev;
+    if (connectionOpen(a, connfd) == NULL)
+    {
+        Close(connfd);
+        return;
+    }
+    metricsAdd(master_metrics->accepted, 1);
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = connfd;
+    Epoll_ctl(a->epfd, EPOLL_CTL_ADD, connfd, &ev);
+}
+
+// out of descriptors (EMFILE/ENFILE): free the reserve descriptor to accept the next
+// pending connection and close it at once. Left in the backlog it would keep the
+// listening socket readable and the acceptor spinning. Logs at most once a second.
+// 0 if a connection was turned away, -1 if none could be
+int acceptShed(acceptor a, int err)
+{
+    int connfd;
+    long now = monotonicMs();
+    if (a->reserve_fd >= 0)
+    {
+        close(a->reserve_fd);
+    }
+    connfd = accept(a->listenfd, NULL, NULL);
+    if (connfd >= 0)
+    {
+        close(connfd);
+        a->shed++;
+    }
+    a->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (now - a->shed_logged_ms >= 1000)
+    {
+        logError("accept: %s, %d connections turned away", strerror(err), a->shed);
+        a->shed = 0;
+        a->shed_logged_ms = now;
+    }
+    errno = err;
+    return connfd >= 0 ? 0 : -1;
+}
+
+// a worker is done with the connection: close it, or give it back to its acceptor
+// the caller must not hold lock, and must have called requestDone already
+void connectionFinish(connection conn)
+{
+    uint64_t one = 1;
+    acceptor a = &acceptors[conn->acceptor];
+    if (!conn->keep_alive)
+    {
+        Close(conn->fd);
+        return;
+    }
+    pthread_mutex_lock(&a->returned_lock);
+    conn->next = a->returned_conns;
+    a->returned_conns = conn;
+    pthread_mutex_unlock(&a->returned_lock);
+    write(a->returned_efd, &one, sizeof(one));
+}
+
+// a connection came back from a worker: admit its next request if it is already here,
+// otherwise wait for it in epoll. its acceptor only
+void connectionPoll(acceptor a, connection conn)
+{
+    struct epoll_event ev;
+    int ready = requestLineReady(conn);
+    if (ready < 0)
+    {
+        Close(conn->fd);
+    }
+    else if (ready > 0)
+    { // pipelined behind the previous request
+        connectionArrived(conn);
+        admitRequest(conn->fd, conn->arrival);
+    }
+    else
+    {
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = conn->fd;
+        Epoll_ctl(a->epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+        idleAppend(a, conn);
+    }
+}
+
+// helper function
+long monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// stamp the arrival of the connection's next request, on both clocks
+void connectionArrived(connection conn)
+{
+    gettimeofday(&conn->arrival, NULL);
+    conn->arrival_ns = metricsNow();
+}
+
+// every connection gets the same timeout, so appending keeps the list ordered by deadline
+void idleAppend(acceptor a, connection conn)
+{
+    conn->deadline = monotonicMs() + keepalive_timeout_ms;
+    conn->next = NULL;
+    conn->prev = a->idle_tail;
+    if (a->idle_tail)
+    {
+        a->idle_tail->next = conn;
+    }
+    else
+    {
+        a->idle_head = conn;
+    }
+    a->idle_tail = conn;
+}
+
+void idleRemove(acceptor a, connection conn)
+{
+    if (conn->prev)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        a->idle_head = conn->next;
+    }
+    if (conn->next)
+    {
+        conn->next->prev = conn->prev;
+    }
+    else
+    {
+        a->idle_tail = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+    conn->deadline = 0;
+}
+
+// ms until the first idle connection times out, -1 if there is none
+int idleTimeout(acceptor a)
+{
+    if (a->idle_head == NULL)
+    {
+        return -1;
+    }
+    long left = a->idle_head->deadline - monotonicMs();
+    return left > 0 ? (int)left : 0;
+}
+
+// Place a connection whose request line is readable in the proper queue,
+// applying the overload policy if the queues are full.
+void admitRequest(int connfd, struct timeval arrival)
+{
+    connection conn = connections[connfd];
+    requestParse(conn); // once, the workers take the result from the connection
+    if (metrics_path && requestIsMetrics(conn, metrics_path))
+    { // answered on a thread of its own, it never waits behind other requests
+        requestServeMetrics(conn);
+        return;
+    }
+    int is_vip = conn->request.is_real; // check if regular or vip
+    int dropped = 0;
+    int priority = conn->request.priority;
+    long deadline = conn->request.est ? arrival.tv_sec * 1000000L + arrival.tv_usec + conn->request.est * 1000 : 0;
+
+    pthread_mutex_lock(&lock); // -------------------------------->
+
+    logDebug("[main] : recieved a task, number:%d", connfd);
+    // proccess full queue according to policy
+    if (totalReqInQueue() >= queue_size)
+    {
+        // if the waiting list is empty or block, then block as usual
+        if (waitingSize() == 0 || strcmp(policy, "block") == 0)
+        { // as it wassssssss
+            waitForRoom();
+        }
+        else if (strcmp(policy, "dt") == 0)
+        { // drop tail - brand new request recieved
+            if (!is_vip)
+            {                                // req is regular - current is considered tail
+                metricsAdd(master_metrics->dropped[METRICS_DT], 1);
+                Close(connfd);               // after empty drop worker hoe req
+                pthread_mutex_unlock(&lock); // ------------------------------^
+                return;
+            }
+            else
+            {                                                     // req is vip - remove from regular
+                int fd_to_delete = waitingDropTail(); // try to dequeue from waiting
+                if (fd_to_delete != -1)
+                { // should always succeed since the waiting should not be empty here
+                    logDebug("[master] dt policy! QueueSize=%d, dropped %d",totalReqInQueue() + 1, fd_to_delete);
+                    metricsAdd(master_metrics->dropped[METRICS_DT], 1);
+                    metricsAdd(master_metrics->evicted, 1);
+                    Close(fd_to_delete);
+                }
+                else
+                { // a sharded worker picked it up meanwhile
+                    waitForRoom();
+                }
+            }
+        }
+        else if (strcmp(policy, "dh") == 0 || strcmp(policy, "codel") == 0)
+        { // drop head - brand old request recieved
+            int fd_to_delete = waitingDropHead();
+            if (fd_to_delete != -1)
+            {                        // check if queue is not empty
+                metricsAdd(master_metrics->dropped[codels ? METRICS_CODEL : METRICS_DH], 1);
+                metricsAdd(master_metrics->evicted, 1);
+                Close(fd_to_delete); // should always succeed since waiting is not empty here
             }
-            if (queueSize(vip_waiting_requests) == 1)
-            { // if first vip req, signal there is pending vip req
-                pthread_cond_signal(&vip_allowed);
+            else
+            { // a sharded worker picked it up meanwhile
+                waitForRoom();
             }
         }
-        else
-        { // worker queue
-            enqueue(waiting_requests, connfd, arrival);
-            if (DEBUG)
-            {
-            gettimeofday(&started, NULL);
-            printf("[master] :adding new worker req. Queuesize=%d,  TotalSize=%d\n", queueSize(waiting_requests), totalReqInQueue());
+        else if (strcmp(policy, "bf") == 0)
+        {                                  // NOT A BUSY WAIT
+            while (totalReqInQueue() != 0) // use a brand new spanking conditional variable to wait till all queues are empty
+            {                              // waiting untill all the requests in the queues are handled
+                logDebug("[master] :block flush cond waiting");
+                pthread_cond_wait(&empty_queue, &lock);
+                logDebug("[master] : return from block flush cond waiting");
             }
-            if (queueEmpty(vip_waiting_requests) && !handeling_vip)
-            {
-                pthread_cond_signal(&worker_allowed);
+            if (!is_vip)
+            {                                // if req A is vip it shouldnt be dropped.
+                metricsAdd(master_metrics->dropped[METRICS_BF], 1);
+                Close(connfd);               // after empty drop worker hoe req
+                pthread_mutex_unlock(&lock); // ------------------------------^
+                return;
+            }
+        }
+        else if (strcmp(policy, "random") == 0)
+        {                                    // drop 50% of the waiting requests by random
+            dropped = waitingDropRandom(random_victims); // should always succeed since waiting is not empty here
+            metricsAdd(master_metrics->dropped[METRICS_RANDOM], dropped);
+            metricsAdd(master_metrics->evicted, dropped);
+            if (dropped == 0)
+            { // only REAL requests are waiting (classes), or a sharded worker took the rest meanwhile
+                waitForRoom();
             }
         }
+    }
 
-        pthread_mutex_unlock(&lock); // ------------------------------^
+    // if we are here, there is place for new req:  assign the new req to proper queue
+    if (is_vip && !classes)
+    {                                                   // vip queue
+        enqueue(vip_waiting_requests, connfd, arrival); // insert new vip req
+        metricsAdd(master_metrics->vip_admitted, 1);
+        if (shards)
+        { // no worker may start a regular request until the vip queue drains
+            shardsPause(shards, 1);
+        }
+        logDebug("[master] :adding new vip req. Queuesize=%d, TotalSize=%d", queueSize(vip_waiting_requests), totalReqInQueue());
+        if (queueSize(vip_waiting_requests) == 1)
+        { // if first vip req, signal there is pending vip req
+            pthread_cond_signal(&vip_allowed);
+        }
+    }
+    else
+    { // worker queue
+        int cls = classes ? (is_vip ? 0 : (priority >= 0 && priority < class_count ? priority : class_count - 1)) : 0;
+        waitingPush(connfd, arrival, deadline, cls);
+        metricsAdd(master_metrics->admitted, 1);
+        logDebug("[master] :adding new worker req. Queuesize=%d,  TotalSize=%d", waitingSize(), totalReqInQueue());
+    }
 
-        //
-        // HW3: In general, don't handle the request in the main thread.
-        // Save the relevant info in a buffer and have one of the worker threads
-        // do the work.
+    pthread_mutex_unlock(&lock); // ------------------------------^
+    for (int i = 0; i < dropped; i++)
+    { // closing takes a while, not worth holding up the workers for
+        Close(random_victims[i]);
     }
 }
 
@@ -187,8 +695,102 @@ void initMaster(int threads_num, int queue_size, pthread_t *worker_threads, pthr
 {
     pthread_mutex_init(&lock, NULL);
     waiting_requests = queueCreate(queue_size);
+    deadline_requests = heapCreate(queue_size);
     vip_waiting_requests = queueCreate(queue_size);
-    handeling_requests = queueCreate(threads_num);
+    handeling_requests = inflightCreate(threads_num);
+    int total_threads = threads_num;
+    pool_extra = pool_max ? pool_max - threads_num : 0;
+    pool_live = threads_num;
+    if (class_count)
+    { // the dedicated threads of every class come after the shared workers
+        classes = classesCreate(class_count, class_weights, queue_size, class_dispatch, class_aging_ms);
+        for (int c = 0; c < class_count; c++)
+        {
+            total_threads += class_threads[c];
+            pthread_cond_init(&class_allowed[c], NULL);
+        }
+        thread_class = (int *)malloc((total_threads + 1 + pool_extra) * sizeof(int));
+        if (thread_class == NULL)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (int t = 0; t < total_threads + 1 + pool_extra; t++)
+        { // the extra workers are shared ones too
+            thread_class[t] = -1;
+        }
+        for (int c = 0, t = threads_num; c < class_count; c++)
+        {
+            for (int k = 0; k < class_threads[c]; k++)
+            {
+                thread_class[t++] = c;
+            }
+        }
+    }
+    struct rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    max_connections = (files.rlim_cur == RLIM_INFINITY || files.rlim_cur > 1 << 20) ? 1 << 20 : (int)files.rlim_cur;
+    connections = (connection *)calloc(max_connections, sizeof(connection));
+    if (connections == NULL)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    acceptors = (struct Acceptor *)calloc(acceptors_num, sizeof(struct Acceptor));
+    if (acceptors == NULL)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int a = 0; a < acceptors_num; a++)
+    {
+        acceptors[a].id = a;
+        pthread_mutex_init(&acceptors[a].returned_lock, NULL);
+        if ((acceptors[a].returned_efd = eventfd(0, EFD_NONBLOCK)) < 0)
+        {
+            unix_error("eventfd error");
+        }
+    }
+    if (shard_placement)
+    {
+        shards = shardsCreate(threads_num, queue_size, shard_placement);
+    }
+    if (cache_size)
+    {
+        static_cache = cacheCreate(cache_size, cache_ttl_ms);
+    }
+    if (cgi_pool_size)
+    {
+        cgi_pool = cgiPoolCreate(cgi_pool_size);
+    }
+    if (coalesce_ttl_ms >= 0)
+    {
+        cgi_flights = flightCreate(coalesce_ttl_ms);
+    }
+    pool_base = total_threads + 1;
+    if (pool_extra)
+    {
+        pool_running = (char *)calloc(pool_extra, sizeof(char));
+        pool_stats = (threads_stats *)calloc(pool_extra, sizeof(threads_stats)); // the first thread with an id allocates its stats, on its own node
+        if (pool_running == NULL || pool_stats == NULL)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (strcmp(policy, "codel") == 0)
+    { // the delay of one queue is controlled by one controller
+        codels = (Codel *)malloc((pool_base + pool_extra) * sizeof(Codel));
+        if (codels == NULL)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < pool_base + pool_extra; i++)
+        {
+            codels[i] = (shards || i == 0) ? codelCreate(codel_target_ms, codel_interval_ms) : codels[0];
+        }
+    }
     pthread_cond_init(&new_req_allowed, NULL);
     pthread_cond_init(&worker_allowed, NULL);
     pthread_cond_init(&vip_allowed, NULL);
@@ -207,21 +809,38 @@ void initMaster(int threads_num, int queue_size, pthread_t *worker_threads, pthr
             exit(EXIT_FAILURE);
         }
         *thread_num = i;
-        pthread_create(&worker_threads[i], NULL, workerThread, thread_num);
-        if(DEBUG){
-            printf("new worker thread created, number: %d\n", i);
+        threadCreate(&worker_threads[i], pin_workers, i, workerThread, thread_num);
+        logDebug("new worker thread created, number: %d", i);
+    }
+    for (; i < total_threads; i++)
+    { // dedicated to one class, they run the worker loop too
+        pthread_t class_thread;
+        int *thread_num = (int *)malloc(sizeof(int));
+        if (thread_num == NULL)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
         }
+        *thread_num = i;
+        threadCreate(&class_thread, pin_workers, i, workerThread, thread_num);
+        logDebug("new class %d thread created, number: %d", thread_class[i], i);
     }
-    int *vip_thread_num = (int *)malloc(sizeof(int));
-    if (vip_thread_num == NULL)
+    if (classes == NULL)
     {
-        perror("malloc failed");
-        exit(EXIT_FAILURE);
+        int *vip_thread_num = (int *)malloc(sizeof(int));
+        if (vip_thread_num == NULL)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        *vip_thread_num = i; // Last value of `i`
+        threadCreate(vip_thread, pin_vip, 0, vipThread, vip_thread_num);
+        logDebug("new vip thread created, number: %d", i);
     }
-    *vip_thread_num = i; // Last value of `i`
-    pthread_create(vip_thread, NULL, vipThread, vip_thread_num);
-    if(DEBUG){
-            printf("new vip thread created, number: %d\n", i);
+    if (pool_extra)
+    {
+        pthread_t pool_thread;
+        pthread_create(&pool_thread, NULL, poolThread, NULL);
     }
     pthread_mutex_unlock(&lock); // ------------------------------^
 }
@@ -230,54 +849,120 @@ void *workerThread(void *thread_number)
 {
     // TODO: make sure these variables are local and not shared through threads
     struct timeval arrival, started, dispatch; // tis was modified
-    threads_stats t_stats = (threads_stats)malloc(sizeof(struct Threads_stats));
-
-    // Thread ID
-    t_stats->id = *(int *)thread_number;
+    struct timespec retire_at;
+    threads_stats t_stats;
+    int id = *(int *)thread_number;
     free(thread_number);
-    // Number of static requests
-    t_stats->stat_req = 0;
-    // Number of dynamic requests
-    t_stats->dynm_req = 0;
-    // Total number of requests
-    t_stats->total_req = 0;
+    int extra = poolExtra(id); // may stop when idle, the next thread with its id carries on its stats
 
-    while (1)
+    if (extra && pool_stats[id - pool_base])
     {
-        pthread_mutex_lock(&lock); // -------------------------------->
+        t_stats = pool_stats[id - pool_base];
+    }
+    else
+    {
+        t_stats = (threads_stats)malloc(sizeof(struct Threads_stats));
+        // Thread ID
+        t_stats->id = id;
+        // Number of static requests
+        t_stats->stat_req = 0;
+        // Number of dynamic requests
+        t_stats->dynm_req = 0;
+        // Total number of requests
+        t_stats->total_req = 0;
+        if (extra)
+        {
+            pool_stats[id - pool_base] = t_stats;
+        }
+    }
+    thread_metrics metrics = metricsSelf(t_stats->id);
+    logSelf(t_stats->id);
+    int only = thread_class ? thread_class[t_stats->id] : -1; // a class thread serves just its class
+    pthread_cond_t *allowed = only == -1 ? &worker_allowed : &class_allowed[only];
 
+    while (1)
+    {
+        int connfd;
+        long deadline = 0;
+        if (shards)
+        { // own shard first, then steal from a peer. never touches the global lock
+            connfd = shardsTake(shards, t_stats->id, &arrival);
+            logDebug("[worker %d] : recieved a task", t_stats->id);
+        }
+        else
+        {
+            pthread_mutex_lock(&lock); // -------------------------------->
 
-        while (queueEmpty(waiting_requests) || !queueEmpty(vip_waiting_requests) || handeling_vip)
-        { // if empty or vip req, wait
-            if (DEBUG)
-            {
-                gettimeofday(&started, NULL);
-                printf("[worker %d] :cond wait at: %ld\n", t_stats->id, started.tv_sec -initt.tv_sec);
+            if (extra)
+            { // stop if there is nothing to do until then
+                clock_gettime(CLOCK_REALTIME, &retire_at);
+                retire_at.tv_sec += pool_cooldown_ms / 1000;
+                retire_at.tv_nsec += (pool_cooldown_ms % 1000) * 1000000L;
+                if (retire_at.tv_nsec >= 1000000000L)
+                {
+                    retire_at.tv_sec++;
+                    retire_at.tv_nsec -= 1000000000L;
+                }
             }
-            pthread_cond_wait(&worker_allowed, &lock);
-            if (DEBUG)
-            {
-                gettimeofday(&started, NULL);
-                printf("[worker %d] : return from cond wait at: %ld\n", t_stats->id, started.tv_sec -initt.tv_sec);
+            while (!waitingReady(only))
+            { // if empty or vip req, wait
+                logDebug("[worker %d] :cond wait", t_stats->id);
+                pool_idle += only == -1;
+                int timed_out = extra ? pthread_cond_timedwait(allowed, &lock, &retire_at) == ETIMEDOUT
+                                      : pthread_cond_wait(allowed, &lock) != 0;
+                pool_idle -= only == -1;
+                logDebug("[worker %d] : return from cond wait", t_stats->id);
+                if (timed_out && extra && !waitingReady(only))
+                {
+                    pool_running[id - pool_base] = 0;
+                    pool_live--;
+                    logInfo("[pool] worker %d stopped, %d running", id, pool_live);
+                    pthread_mutex_unlock(&lock); // ------------------------------^
+                    uringSendRelease();
+                    return NULL;
+                }
             }
+            logDebug("[worker %d] : recieved a task", t_stats->id);
+            // if I'm here, means there is worker request and I can handle it.
+            // pop from waiting, insert to handeling:
+            connfd = waitingTake(only, &arrival, &deadline);
+
+            pthread_mutex_unlock(&lock); // ------------------------------^
         }
-        if (DEBUG)
+
+        if (deadline)
         {
             gettimeofday(&started, NULL);
-            printf("[worker %d] : recieved a task at: %ld\n", t_stats->id, started.tv_sec -initt.tv_sec);
+            if (started.tv_sec * 1000000L + started.tv_usec > deadline)
+            { // too late to be of any use, drop it instead of doing the work
+                pthread_mutex_lock(&lock); // -------------------------------->
+                requestDone(connfd);
+                pthread_mutex_unlock(&lock); // ------------------------------^
+                metricsAdd(metrics->dropped[METRICS_EXPIRED], 1);
+                metricsAdd(metrics->evicted, 1);
+                logDebug("[worker %d] : deadline passed, dropped %d", t_stats->id, connfd);
+                Close(connfd);
+                continue;
+            }
         }
-        // if I'm here, means there is worker request and I can handle it.
-        // pop from waiting, insert to handeling:
-        arrival = queueHeadArrivalTime(waiting_requests);
-        int connfd = dequeue(waiting_requests);
-        enqueue(handeling_requests, connfd, arrival);
 
-        pthread_mutex_unlock(&lock); // ------------------------------^
+        if (codels && codelDrop(codels[t_stats->id], arrival))
+        { // it waited in a standing queue, drop it from the head
+            pthread_mutex_lock(&lock); // -------------------------------->
+            requestDone(connfd);
+            pthread_mutex_unlock(&lock); // ------------------------------^
+            metricsAdd(metrics->dropped[METRICS_CODEL], 1);
+            metricsAdd(metrics->evicted, 1);
+            logDebug("[worker %d] : codel dropped %d", t_stats->id, connfd);
+            Close(connfd);
+            continue;
+        }
 
+        metricsAdd(metrics->started, 1);
         gettimeofday(&started, NULL);            // make sure its the difference between
         timersub(&started, &arrival, &dispatch); // dispatch = started - arrival
 
-        int skip_invoked = requestHandle(connfd, arrival, dispatch, t_stats); // perfrom request outside of lock
+        int skip_invoked = requestHandle(connections[connfd], arrival, dispatch, t_stats); // perfrom request outside of lock
         // if (DEBUG)
         // {
         //     printf("[worker %d] :return from handle! skip_invoked=%d\n", skip_invoked);
@@ -285,74 +970,55 @@ void *workerThread(void *thread_number)
         //         printf("indise if\n");
         //     }
         // }   
-        Close(connfd);
+        publishStats(metrics, t_stats);
 
         pthread_mutex_lock(&lock); // -------------------------------->
-        dequeueByReq(handeling_requests, connfd); // validate after handling A
-        if (totalReqInQueue() < queue_size)
-        { // this req is done. get another one by master
-            pthread_cond_signal(&new_req_allowed);
-        }
-        if (totalReqInQueue() == 0)
-        { // for block_flush
-            pthread_cond_signal(&empty_queue);
-        }
+        requestDone(connfd); // validate after handling A
 
         int skip_connfd;
         if (skip_invoked)
         {              
-            if (DEBUG)
-            {
-                printf("[worker %d] : skip invoked !Wait QeueuSize=%d, TotalSize=%d\n", t_stats->id, queueSize(waiting_requests), totalReqInQueue());
-            }    
+            logDebug("[worker %d] : skip invoked !Wait QeueuSize=%d, TotalSize=%d", t_stats->id, waitingSize(), totalReqInQueue());    
                                                    // need to handle latest req by the sme thread
-            arrival = queueTailArrivalTime(waiting_requests); // to be changed
-            skip_connfd = skipDequeue(waiting_requests);
+            skip_connfd = waitingTakeNewest(&arrival);
             if (skip_connfd == -1)
             { // no new fd found
                 skip_invoked = 0;
             }
             else
             {
-                enqueue(handeling_requests, skip_connfd, arrival);
+                metricsAdd(metrics->started, 1);
             }
             // do we want to change the fd of ourselves or does it not mean anything?
             // if error accures, notice handling_queue
         }
         pthread_mutex_unlock(&lock); // ------------------------------^
+        metricsAdd(metrics->finished, 1);
+        connectionFinish(connections[connfd]); // only once it left handeling, a kept-alive fd may come right back
 
         if (skip_invoked)
         {      
-            if (DEBUG)
-            {
-                printf("[worker %d] : skip invoked ! handling !, TotalSize=%d\n", t_stats->id, totalReqInQueue());
-            }                                      // not supposed to check reccursive skip
+            logDebug("[worker %d] : skip invoked ! handling !, TotalSize=%d", t_stats->id, totalReqInQueue());                                      // not supposed to check reccursive skip
             gettimeofday(&started, NULL);            // make sure its the difference between
             timersub(&started, &arrival, &dispatch); // dispatch = started - arrival
 
-            requestHandle(skip_connfd, arrival, dispatch, t_stats);
-            Close(skip_connfd);
+            requestHandle(connections[skip_connfd], arrival, dispatch, t_stats);
+            publishStats(metrics, t_stats);
         }
 
         pthread_mutex_lock(&lock); // -------------------------------->
-        if (DEBUG)
-        {
-            printf("[worker %d] : finished a task, TotalSize=%d\n", t_stats->id,  totalReqInQueue());
-        }
+        logDebug("[worker %d] : finished a task, TotalSize=%d", t_stats->id,  totalReqInQueue());
         if (skip_invoked)
         {
-            dequeueByReq(handeling_requests, skip_connfd);
-            if (totalReqInQueue() < queue_size)
-            { // this req is done. get another one by master
-                pthread_cond_signal(&new_req_allowed);
-            }
-            if (totalReqInQueue() == 0)
-            { // for block_flush
-                pthread_cond_signal(&empty_queue);
-            }
+            requestDone(skip_connfd);
         }
 
         pthread_mutex_unlock(&lock); // ------------------------------^
+        if (skip_invoked)
+        {
+            metricsAdd(metrics->finished, 1);
+            connectionFinish(connections[skip_connfd]);
+        }
     }
 }
 
@@ -371,6 +1037,8 @@ void *vipThread(void *thread_number)
     t_stats->dynm_req = 0;
     // Total number of requests
     t_stats->total_req = 0;
+    thread_metrics metrics = metricsSelf(t_stats->id);
+    logSelf(t_stats->id);
 
     while (1)
     {
@@ -378,49 +1046,35 @@ void *vipThread(void *thread_number)
 
         while (queueEmpty(vip_waiting_requests))
         { // if no vip req, wait
-            if (DEBUG)
-            {
-            gettimeofday(&started, NULL);
-            printf("[vip] : cond waiting at:%ld\n", started.tv_sec -initt.tv_sec);
-            }
+            logDebug("[vip] : cond waiting");
             pthread_cond_wait(&vip_allowed, &lock);
-            if (DEBUG)
-            {
-            gettimeofday(&started, NULL);
-            printf("[vip] : return from cond waiting at:%ld\n", started.tv_sec -initt.tv_sec);
-            }
+            logDebug("[vip] : return from cond waiting");
         }
 
         handeling_vip = 1;
         // if I'm here, means there is vip request and I can handle it.
         arrival = queueHeadArrivalTime(vip_waiting_requests);
         int connfd = dequeue(vip_waiting_requests);
-        if (DEBUG)
-        {
-            gettimeofday(&started, NULL);
-            printf("[vip] : recieved a task from: %ld by time: %ld\n", arrival.tv_sec, started.tv_sec-initt.tv_sec);
-        }
+        logDebug("[vip] : recieved a task from: %ld", arrival.tv_sec);
         pthread_mutex_unlock(&lock); // ------------------------------^
+        metricsAdd(metrics->vip_started, 1);
 
         gettimeofday(&started, NULL);            // make sure its the difference between
         timersub(&started, &arrival, &dispatch); // dispatch = started - arrival
 
-        requestHandle(connfd, arrival, dispatch, t_stats); // perfrom request outside of lock
-        Close(connfd);
+        requestHandle(connections[connfd], arrival, dispatch, t_stats); // perfrom request outside of lock
+        publishStats(metrics, t_stats);
 
         pthread_mutex_lock(&lock); // -------------------------------->
         handeling_vip = 0;
-        if (DEBUG)
-        {
-            printf("[vip] : finished task %d, TotalSize=%d\n", connfd,  totalReqInQueue());
+        logDebug("[vip] : finished task %d, TotalSize=%d", connfd,  totalReqInQueue());
+        if (shards && queueEmpty(vip_waiting_requests))
+        { // if no more vip - let the workers take from their shards again
+            shardsPause(shards, 0);
         }
-        if (queueEmpty(vip_waiting_requests) && !queueEmpty(waiting_requests) && !handeling_vip)
+        else if (queueEmpty(vip_waiting_requests) && waitingSize() > 0 && !handeling_vip)
         { // if no more vip - pull worker req
-            if (DEBUG)
-            {
-                gettimeofday(&started, NULL);
-                printf("[vip] : no more vip, waking all workers at:%ld\n", started.tv_sec -initt.tv_sec);
-            }
+            logDebug("[vip] : no more vip, waking all workers");
             pthread_cond_broadcast(&worker_allowed);
         }
         if (totalReqInQueue() < queue_size)
@@ -429,11 +1083,92 @@ void *vipThread(void *thread_number)
         }
         if (totalReqInQueue() == 0)
         { // for block_flush
-            pthread_cond_signal(&empty_queue);
+            pthread_cond_broadcast(&empty_queue);
+        }
+
+        pthread_mutex_unlock(&lock); // ------------------------------^
+        metricsAdd(metrics->vip_finished, 1);
+        connectionFinish(connections[connfd]);
+    }
+}
+
+// start a thread, pinned as its kind's --pin-* option says. one that may not run
+// on those CPUs (cpuset) runs unpinned
+int threadCreate(pthread_t *thread, Affinity pin, int index, void *(*start)(void *), void *arg)
+{
+    if (affinityCreate(thread, pin, index, start, arg) == 0)
+    {
+        return 0;
+    }
+    logError("could not pin thread %d, it runs unpinned", index);
+    return pthread_create(thread, NULL, start, arg);
+}
+
+// true for the ids of the workers the elastic pool adds and removes
+int poolExtra(int id)
+{
+    return pool_extra && id >= pool_base && id < pool_base + pool_extra;
+}
+
+// start an extra worker on the lowest free id, the caller holds lock
+void poolSpawn()
+{
+    pthread_t thread;
+    for (int e = 0; e < pool_extra; e++)
+    {
+        if (pool_running[e])
+        {
+            continue;
         }
+        int *thread_num = (int *)malloc(sizeof(int));
+        if (thread_num == NULL)
+        {
+            perror("malloc failed");
+            return;
+        }
+        *thread_num = pool_base + e;
+        if (threadCreate(&thread, pin_workers, pool_base + e, workerThread, thread_num) != 0)
+        {
+            free(thread_num);
+            return;
+        }
+        pthread_detach(thread);
+        pool_running[e] = 1;
+        pool_live++;
+        logInfo("[pool] worker %d started, %d running", pool_base + e, pool_live);
+        return;
+    }
+}
 
+// Grows the elastic pool: looks at the queues a few times per --scale-wait and
+// adds a worker while requests keep waiting with no worker free to take them
+void *poolThread(void *arg)
+{
+    struct timespec tick = {0, (pool_scale_wait_ms / 4 + 1) * 1000000L};
+    long busy_since = 0; // requests have been waiting with every worker busy since then
+    while (1)
+    {
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&lock); // -------------------------------->
+        int backlog = pool_idle == 0 && waitingReady(-1) ? waitingSize() : 0;
+        long now = monotonicMs();
+        if (backlog == 0)
+        {
+            busy_since = 0;
+        }
+        else if (busy_since == 0)
+        {
+            busy_since = now;
+        }
+        if (backlog && pool_live < pool_max &&
+            (now - busy_since >= pool_scale_wait_ms || (pool_scale_depth && backlog >= pool_scale_depth)))
+        {
+            poolSpawn();
+            busy_since = now; // give it time to make a difference
+        }
         pthread_mutex_unlock(&lock); // ------------------------------^
     }
+    return NULL;
 }
 
 int isValidPolicy(char *policy)
@@ -453,7 +1188,7 @@ void getargs(int *port, int *threads_num, int *queue_size, char *policy, int arg
 {
     if (argc < 5)
     {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <port> <threads> <queue_size> <policy> [options]\n", argv[0]);
         exit(1);
     }
     *port = atoi(argv[1]);
@@ -465,16 +1200,486 @@ void getargs(int *port, int *threads_num, int *queue_size, char *policy, int arg
         exit(1);
     }
     strcpy(policy, argv[4]);
+    getoptions(argc, argv);
+    if (class_count && shard_placement)
+    { // the shards have no room for classes
+        exit(1);
+    }
+    if (pool_max && (pool_max < *threads_num || shard_placement))
+    { // a shard per worker is fixed at startup
+        exit(1);
+    }
+}
+
+// Optional flags after the policy, each --name=value
+void getoptions(int argc, char *argv[])
+{
+    for (int i = 5; i < argc; i++)
+    {
+        char *value = strchr(argv[i], '=');
+        if (value == NULL)
+        { // every option takes a value
+            exit(1);
+        }
+        value++;
+        if (strncmp(argv[i], "--shards=", value - argv[i]) == 0)
+        {
+            if (strcmp(value, "rr") == 0)
+            {
+                shard_placement = SHARDS_RR;
+            }
+            else if (strcmp(value, "least") == 0)
+            {
+                shard_placement = SHARDS_LEAST;
+            }
+            else
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--static=", value - argv[i]) == 0)
+        {
+            if (strcmp(value, "sendfile") == 0)
+            {
+                static_send_mode = STATIC_SENDFILE;
+            }
+            else if (strcmp(value, "mmap") == 0)
+            {
+                static_send_mode = STATIC_MMAP;
+            }
+            else
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--cache=", value - argv[i]) == 0)
+        {
+            if ((cache_size = parseSize(value)) <= 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--cache-ttl=", value - argv[i]) == 0)
+        {
+            cache_ttl_ms = atoi(value);
+            if (cache_ttl_ms < 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--keepalive=", value - argv[i]) == 0)
+        {
+            keepalive_timeout_ms = strcmp(value, "off") == 0 ? 0 : atoi(value);
+            if (keepalive_timeout_ms < 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--keepalive-max=", value - argv[i]) == 0)
+        {
+            if ((keepalive_max = atoi(value)) <= 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--metrics=", value - argv[i]) == 0)
+        {
+            if (value[0] != '/')
+            {
+                exit(1);
+            }
+            metrics_path = value;
+        }
+        else if (strncmp(argv[i], "--classes=", value - argv[i]) == 0)
+        {
+            if (parseClasses(value) < 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--class-dispatch=", value - argv[i]) == 0)
+        {
+            if (strcmp(value, "wfq") == 0)
+            {
+                class_dispatch = CLASSES_WFQ;
+            }
+            else if (strcmp(value, "strict") == 0)
+            {
+                class_dispatch = CLASSES_STRICT;
+            }
+            else
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--class-aging=", value - argv[i]) == 0)
+        {
+            if ((class_aging_ms = atoi(value)) < 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--codel-target=", value - argv[i]) == 0)
+        {
+            if ((codel_target_ms = atoi(value)) <= 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--codel-interval=", value - argv[i]) == 0)
+        {
+            if ((codel_interval_ms = atoi(value)) <= 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--threads-max=", value - argv[i]) == 0)
+        {
+            if ((pool_max = atoi(value)) <= 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--scale-wait=", value - argv[i]) == 0)
+        {
+            if ((pool_scale_wait_ms = atoi(value)) <= 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--scale-depth=", value - argv[i]) == 0)
+        {
+            if ((pool_scale_depth = atoi(value)) < 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--scale-cooldown=", value - argv[i]) == 0)
+        {
+            if ((pool_cooldown_ms = atoi(value)) <= 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--pin-workers=", value - argv[i]) == 0)
+        {
+            if ((pin_workers = affinityParse(value)) == NULL)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--pin-vip=", value - argv[i]) == 0)
+        {
+            if ((pin_vip = affinityParse(value)) == NULL)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--pin-acceptors=", value - argv[i]) == 0)
+        {
+            if ((pin_acceptors = affinityParse(value)) == NULL)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--acceptors=", value - argv[i]) == 0)
+        {
+            if ((acceptors_num = atoi(value)) <= 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--log=", value - argv[i]) == 0)
+        {
+            if ((log_option = logParseLevel(value)) < 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--cgi-pool=", value - argv[i]) == 0)
+        {
+            if ((cgi_pool_size = atoi(value)) <= 0)
+            {
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--coalesce=", value - argv[i]) == 0)
+        {
+            if ((coalesce_ttl_ms = atoi(value)) < 0)
+            {
+                exit(1);
+            }
+        }
+        else
+        { // unknown option
+            exit(1);
+        }
+    }
+}
+
+// parse "<weight>[/<threads>],..." into the class settings, -1 if malformed
+int parseClasses(char *value)
+{
+    char *end = value;
+    class_count = 0;
+    while (class_count < CLASSES_MAX)
+    {
+        class_weights[class_count] = strtol(end, &end, 10);
+        class_threads[class_count] = 0;
+        if (*end == '/')
+        {
+            class_threads[class_count] = strtol(end + 1, &end, 10);
+        }
+        if (class_weights[class_count] <= 0 || class_threads[class_count] < 0)
+        {
+            return -1;
+        }
+        class_count++;
+        if (*end != ',')
+        {
+            break;
+        }
+        end++;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+// parse a byte count with an optional K/M/G suffix, -1 if malformed
+long parseSize(char *value)
+{
+    char *end;
+    long size = strtol(value, &end, 10);
+    switch (*end)
+    {
+    case 'G': case 'g': size *= 1024; // fall through
+    case 'M': case 'm': size *= 1024; // fall through
+    case 'K': case 'k': size *= 1024; end++; break;
+    }
+    return (*end == '\0' && end != value) ? size : -1;
 }
 
 // just to make code more readable
 int totalReqInQueue()
 {
-    return queueSize(vip_waiting_requests) + queueSize(waiting_requests) + queueSize(handeling_requests) + handeling_vip;
+    if (shards)
+    {
+        return queueSize(vip_waiting_requests) + sharded_total + handeling_vip;
+    }
+    return queueSize(vip_waiting_requests) + waitingSize() + inflightSize(handeling_requests) + handeling_vip;
 }
 
 // return number of waiting requests
 int totalWaitReqInQueue()
 {
-    return queueSize(vip_waiting_requests) + queueSize(waiting_requests);
+    return queueSize(vip_waiting_requests) + waitingSize();
+}
+
+// regular requests waiting for a worker
+int waitingSize()
+{
+    if (classes)
+    {
+        return classesWaiting(classes);
+    }
+    return shards ? shardsWaiting(shards) : queueSize(waiting_requests) + heapSize(deadline_requests);
+}
+
+// may a worker (only == -1) or a thread of class only start a request now. not sharded, the caller holds lock
+int waitingReady(int only)
+{
+    if (classes)
+    {
+        return only == -1 ? classesWaiting(classes) > 0 : classesWaitingIn(classes, only) > 0;
+    }
+    return waitingSize() > 0 && queueEmpty(vip_waiting_requests) && !handeling_vip;
+}
+
+// queue a regular request and wake a worker for it, the caller holds lock
+// deadline: latest useful start (us since the epoch), 0 for none. cls: its class with --classes
+void waitingPush(int connfd, struct timeval arrival, long deadline, int cls)
+{
+    if (shards)
+    {
+        sharded_total++;
+        shardsPush(shards, connfd, arrival);
+        return;
+    }
+    if (classes)
+    { // either one of its own threads or a shared worker may take it
+        classesPush(classes, cls, connfd, arrival);
+        pthread_cond_signal(&class_allowed[cls]);
+        pthread_cond_signal(&worker_allowed);
+        return;
+    }
+    if (deadline)
+    {
+        heapPush(deadline_requests, connfd, arrival, deadline);
+    }
+    else
+    {
+        enqueue(waiting_requests, connfd, arrival);
+    }
+    if (queueEmpty(vip_waiting_requests) && !handeling_vip)
+    {
+        pthread_cond_signal(&worker_allowed);
+    }
+}
+
+// start the next regular request: the earliest deadline, or else the oldest; with classes, the
+// next of class only or of the class the dispatch policy picks. not sharded, the caller holds lock
+int waitingTake(int only, struct timeval *arrival, long *deadline)
+{
+    int connfd;
+    if (classes)
+    {
+        *deadline = 0;
+        connfd = classesPick(classes, only, arrival);
+    }
+    else if (!heapEmpty(deadline_requests))
+    {
+        connfd = heapPop(deadline_requests, arrival, deadline);
+    }
+    else
+    {
+        *arrival = queueHeadArrivalTime(waiting_requests);
+        *deadline = 0;
+        connfd = dequeue(waiting_requests);
+    }
+    inflightAdd(handeling_requests, connfd, *arrival);
+    return connfd;
+}
+
+// remove the oldest waiting regular request (the most urgent one if only deadlines wait), the caller holds lock
+int waitingDropHead()
+{
+    if (shards)
+    {
+        struct timeval arrival;
+        int connfd = shardsDropHead(shards, &arrival);
+        if (connfd != -1)
+        {
+            sharded_total--;
+        }
+        return connfd;
+    }
+    if (classes)
+    { // the least important class loses first, class 0 (REAL) never
+        struct timeval arrival;
+        return classesDropHead(classes, &arrival);
+    }
+    if (queueEmpty(waiting_requests))
+    {
+        return heapPop(deadline_requests, NULL, NULL);
+    }
+    return dequeue(waiting_requests);
+}
+
+// remove the newest waiting regular request, the caller holds lock
+int waitingDropTail()
+{
+    if (shards)
+    {
+        struct timeval arrival;
+        int connfd = shardsDropTail(shards, &arrival);
+        if (connfd != -1)
+        {
+            sharded_total--;
+        }
+        return connfd;
+    }
+    if (classes)
+    {
+        struct timeval arrival;
+        return classesDropTail(classes, &arrival);
+    }
+    if (queueEmpty(waiting_requests))
+    { // the least urgent
+        return heapPopLatest(deadline_requests, NULL);
+    }
+    return dequeueTail(waiting_requests);
+}
+
+// unlink half of the waiting regular requests for policy random, returns how many.
+// the caller closes the victims after releasing lock
+int waitingDropRandom(int *victims)
+{
+    struct Eviction e;
+    if (shards)
+    {
+        int dropped = shardsDropRandom(shards, victims);
+        sharded_total -= dropped;
+        return dropped;
+    }
+    if (classes)
+    {
+        return classesDropRandom(classes, victims);
+    }
+    // one draw over the fifo and the heap together
+    evictionStart(&e, queueSize(waiting_requests) + heapSize(deadline_requests), victims);
+    queueDropRandom(waiting_requests, &e);
+    heapDropRandom(deadline_requests, &e);
+    return e.count;
+}
+
+// copy a thread's request counts where the metrics endpoint can read them
+void publishStats(thread_metrics metrics, threads_stats t_stats)
+{
+    atomic_store_explicit(&metrics->static_req, t_stats->stat_req, memory_order_relaxed);
+    atomic_store_explicit(&metrics->dynamic_req, t_stats->dynm_req, memory_order_relaxed);
+}
+
+// move the newest waiting regular request straight to handling (.skip), the caller holds lock
+int waitingTakeNewest(struct timeval *arrival)
+{
+    if (shards)
+    { // still counted in sharded_total until requestDone
+        return shardsDropTail(shards, arrival);
+    }
+    int connfd;
+    if (classes)
+    {
+        connfd = classesDropTail(classes, arrival);
+    }
+    else
+    {
+        *arrival = queueTailArrivalTime(waiting_requests);
+        connfd = skipDequeue(waiting_requests);
+    }
+    if (connfd != -1)
+    {
+        inflightAdd(handeling_requests, connfd, *arrival);
+    }
+    return connfd;
+}
+
+// block the master until the queues have room, the caller holds lock
+void waitForRoom()
+{
+    while (totalReqInQueue() >= queue_size)
+    { // waiting for place in wait queue
+        logDebug("[master] : cond waiting");
+        pthread_cond_wait(&new_req_allowed, &lock);
+        logDebug("[master] : return from cond waiting");
+    }
+}
+
+// a worker finished a regular request, the caller holds lock
+void requestDone(int connfd)
+{
+    if (shards)
+    {
+        sharded_total--;
+    }
+    else
+    {
+        inflightRemove(handeling_requests, connfd);
+    }
+    if (totalReqInQueue() < queue_size)
+    { // this req is done. get another one by master
+        pthread_cond_signal(&new_req_allowed);
+    }
+    if (totalReqInQueue() == 0)
+    { // for block_flush
+        pthread_cond_broadcast(&empty_queue);
+    }
 }
@@ -0,0 +1,246 @@
+#include "shards.h"
+#include "queue.h"
+#include "segel.h"
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+
+// a worker's own waiting queue. queued/busy are also kept as atomics so that
+// placement and stealing can look at a shard without taking its lock
+struct Shard {
+    pthread_mutex_t lock;
+    pthread_cond_t work_allowed;
+    Queue requests;
+    int idle;               // owner is waiting on work_allowed
+    atomic_int queued;      // == queueSize(requests)
+    atomic_int busy;        // owner is handling a request
+} __attribute__((aligned(CACHE_LINE)));
+
+struct Shards {
+    int count;
+    int placement;
+    int next;               // round robin cursor, used by the acceptor only
+    atomic_int waiting;     // requests waiting in all shards
+    atomic_int paused;
+    struct Shard *shards;
+};
+
+// Create count shards, each able to hold size requests
+Shards shardsCreate(int count, int size, int placement){
+    Shards s = (Shards)malloc(sizeof(*s));
+    if(s == NULL || posix_memalign((void **)&s->shards, CACHE_LINE, sizeof(struct Shard) * count) != 0){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    s->count = count;
+    s->placement = placement;
+    s->next = 0;
+    atomic_init(&s->waiting, 0);
+    atomic_init(&s->paused, 0);
+    for(int i = 0; i < count; i++){
+        struct Shard *shard = &s->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->work_allowed, NULL);
+        shard->requests = queueCreate(size);
+        shard->idle = 0;
+        atomic_init(&shard->queued, 0);
+        atomic_init(&shard->busy, 0);
+    }
+    return s;
+}
+
+int shardsWaiting(Shards s){
+    return atomic_load(&s->waiting);
+}
+
+// pop the head of a shard, the caller holds its lock
+// helper function
+static int shardPop(Shards s, struct Shard *shard, struct timeval *arrival){
+    *arrival = queueHeadArrivalTime(shard->requests);
+    int descriptor = dequeue(shard->requests);
+    if(descriptor != -1){
+        atomic_fetch_sub(&shard->queued, 1);
+        atomic_fetch_sub(&s->waiting, 1);
+    }
+    return descriptor;
+}
+
+// choose the shard for a new request
+// helper function
+static int shardsPlace(Shards s){
+    if(s->placement == SHARDS_RR){
+        int index = s->next;
+        s->next = (s->next + 1) % s->count;
+        return index;
+    }
+    int best = 0, best_load = -1;
+    for(int i = 0; i < s->count; i++){
+        int load = atomic_load(&s->shards[i].queued) + atomic_load(&s->shards[i].busy);
+        if(best_load == -1 || load < best_load){
+            best = i;
+            best_load = load;
+            if(load == 0)
+                break;
+        }
+    }
+    return best;
+}
+
+// wake one idle worker other than skip, so it can steal
+// helper function
+static void shardsWakeIdle(Shards s, int skip){
+    for(int k = 1; k < s->count; k++){
+        struct Shard *shard = &s->shards[(skip + k) % s->count];
+        pthread_mutex_lock(&shard->lock);
+        if(shard->idle){
+            pthread_cond_signal(&shard->work_allowed);
+            pthread_mutex_unlock(&shard->lock);
+            return;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void shardsPush(Shards s, int descriptor, struct timeval arrival){
+    int index = shardsPlace(s);
+    struct Shard *shard = &s->shards[index];
+
+    pthread_mutex_lock(&shard->lock);
+    enqueue(shard->requests, descriptor, arrival);
+    atomic_fetch_add(&shard->queued, 1);
+    atomic_fetch_add(&s->waiting, 1);
+    int owner_busy = !shard->idle;
+    pthread_cond_signal(&shard->work_allowed);
+    pthread_mutex_unlock(&shard->lock);
+
+    if(owner_busy){ // the owner will not get to it soon, let an idle peer steal it
+        shardsWakeIdle(s, index);
+    }
+}
+
+// take the head of the first peer shard that has one
+// helper function
+static int shardsSteal(Shards s, int self, struct timeval *arrival){
+    for(int k = 1; k < s->count; k++){
+        struct Shard *victim = &s->shards[(self + k) % s->count];
+        if(atomic_load(&victim->queued) == 0)
+            continue;
+        pthread_mutex_lock(&victim->lock);
+        int descriptor = shardPop(s, victim, arrival);
+        pthread_mutex_unlock(&victim->lock);
+        if(descriptor != -1)
+            return descriptor;
+    }
+    return -1;
+}
+
+int shardsTake(Shards s, int self, struct timeval *arrival){
+    struct Shard *me = &s->shards[self];
+    int descriptor;
+
+    pthread_mutex_lock(&me->lock);
+    atomic_store(&me->busy, 0);
+    while(1){
+        if(!atomic_load(&s->paused)){
+            if((descriptor = shardPop(s, me, arrival)) != -1)
+                break;
+            if(atomic_load(&s->waiting) > 0){ // never hold two shard locks at once
+                pthread_mutex_unlock(&me->lock);
+                descriptor = shardsSteal(s, self, arrival);
+                pthread_mutex_lock(&me->lock);
+                if(descriptor != -1)
+                    break;
+                continue;
+            }
+        }
+        // a push, a steal-wakeup or the end of a pause changes the state under this lock before signaling
+        me->idle = 1;
+        pthread_cond_wait(&me->work_allowed, &me->lock);
+        me->idle = 0;
+    }
+    atomic_store(&me->busy, 1);
+    pthread_mutex_unlock(&me->lock);
+    return descriptor;
+}
+
+// lock every shard, always in index order
+// helper function
+static void shardsLockAll(Shards s){
+    for(int i = 0; i < s->count; i++)
+        pthread_mutex_lock(&s->shards[i].lock);
+}
+
+// helper function
+static void shardsUnlockAll(Shards s){
+    for(int i = s->count - 1; i >= 0; i--)
+        pthread_mutex_unlock(&s->shards[i].lock);
+}
+
+int shardsDropHead(Shards s, struct timeval *arrival){
+    shardsLockAll(s);
+    struct Shard *oldest = NULL;
+    for(int i = 0; i < s->count; i++){
+        struct Shard *shard = &s->shards[i];
+        if(queueEmpty(shard->requests))
+            continue;
+        struct timeval head = queueHeadArrivalTime(shard->requests);
+        if(oldest == NULL || timercmp(&head, arrival, <)){
+            oldest = shard;
+            *arrival = head;
+        }
+    }
+    int descriptor = oldest ? shardPop(s, oldest, arrival) : -1;
+    shardsUnlockAll(s);
+    return descriptor;
+}
+
+int shardsDropTail(Shards s, struct timeval *arrival){
+    shardsLockAll(s);
+    struct Shard *newest = NULL;
+    for(int i = 0; i < s->count; i++){
+        struct Shard *shard = &s->shards[i];
+        if(queueEmpty(shard->requests))
+            continue;
+        struct timeval tail = queueTailArrivalTime(shard->requests);
+        if(newest == NULL || !timercmp(&tail, arrival, <)){
+            newest = shard;
+            *arrival = tail;
+        }
+    }
+    int descriptor = -1;
+    if(newest != NULL){
+        descriptor = dequeueTail(newest->requests);
+        atomic_fetch_sub(&newest->queued, 1);
+        atomic_fetch_sub(&s->waiting, 1);
+    }
+    shardsUnlockAll(s);
+    return descriptor;
+}
+
+int shardsDropRandom(Shards s, int *victims){
+    struct Eviction e;
+    int waiting = 0;
+    shardsLockAll(s);
+    for(int i = 0; i < s->count; i++)
+        waiting += queueSize(s->shards[i].requests);
+    evictionStart(&e, waiting, victims);
+    for(int i = 0; i < s->count; i++){
+        struct Shard *shard = &s->shards[i];
+        int removed = queueDropRandom(shard->requests, &e);
+        atomic_fetch_sub(&shard->queued, removed);
+        atomic_fetch_sub(&s->waiting, removed);
+    }
+    shardsUnlockAll(s);
+    return e.count;
+}
+
+void shardsPause(Shards s, int paused){
+    atomic_store(&s->paused, paused);
+    if(paused)
+        return;
+    for(int i = 0; i < s->count; i++){
+        pthread_mutex_lock(&s->shards[i].lock);
+        pthread_cond_signal(&s->shards[i].work_allowed);
+        pthread_mutex_unlock(&s->shards[i].lock);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <sys/time.h>
+
+//
+// shards.c: one waiting queue per worker thread, with work stealing.
+//
+// Every shard has its own lock and condition variable, so picking up a request
+// only touches the worker's own shard (or, when it is empty, a peer's shard).
+// The acceptor still decides admission and drops under the server lock,
+// and reaches into the shards only to push a request or to drop one.
+//
+
+#define SHARDS_RR 1     // new requests go to the shards in turn
+#define SHARDS_LEAST 2  // new requests go to the shard with the fewest queued + running requests
+
+typedef struct Shards *Shards;
+
+Shards shardsCreate(int count, int size, int placement);
+
+// number of requests waiting in all shards
+int shardsWaiting(Shards s);
+
+// queue a new request on a shard chosen by the placement policy and wake a worker for it
+void shardsPush(Shards s, int descriptor, struct timeval arrival);
+
+// block until worker self may start a request, from its own shard or stolen from a peer
+int shardsTake(Shards s, int self, struct timeval *arrival);
+
+// remove the oldest / newest waiting request over all shards, -1 if none
+int shardsDropHead(Shards s, struct timeval *arrival);
+int shardsDropTail(Shards s, struct timeval *arrival);
+
+// unlink half of the waiting requests (rounded up), picked at random over all shards
+// (policy "random"). their descriptors go to victims, returns how many
+int shardsDropRandom(Shards s, int *victims);
+
+// while paused no worker starts a new request (a vip request is pending or running)
+void shardsPause(Shards s, int paused);
+
+#endif // SHARDS_H
@@ -61,6 +61,96 @@ void runQueueTests() {
     // Destroy queue
     printf("\nDestroying queue...\n");
     queueDestroy(q);
+
+    // Requests keep their order when the ring wraps around
+    printf("\n--- Wrap Around ---\n");
+    q = queueCreate(3);
+    enqueue(q, 100, time1);
+    enqueue(q, 200, time2);
+    enqueue(q, 300, time3);
+    dequeue(q);
+    dequeue(q);
+    enqueue(q, 400, time4);
+    enqueue(q, 500, time4);
+    queuePrint(q);
+    printf("Finding request with descriptor 500: Index %d\n", queueFindReq(q, 500));
+    printf("Dequeued tail descriptor: %d\n", dequeueTail(q));
+    queuePrint(q);
+    enqueue(q, 600, time4);
+    printf("Dequeued request at index 1: %d\n", dequeueByIndex(q, 1));  // Removes request 400
+    queuePrint(q);
+    printf("Head descriptor: %d\n", headDesciprot(q));
+    queueDestroy(q);
+
+    // In-flight table
+    printf("\n--- In-Flight Requests ---\n");
+    Inflight t = inflightCreate(2);
+    inflightAdd(t, 5, time1);
+    inflightAdd(t, 70, time2);  // beyond initial capacity
+    inflightAdd(t, 5, time3);   // already there, ignored
+    printf("In-flight size: %d\n", inflightSize(t));
+    printf("Contains 70? %s\n", inflightContains(t, 70) ? "Yes" : "No");
+    inflightRemove(t, 5);
+    inflightRemove(t, 6);       // not there, ignored
+    printf("In-flight size after removal: %d\n", inflightSize(t));
+    printf("Contains 5? %s\n", inflightContains(t, 5) ? "Yes" : "No");
+    inflightDestroy(t);
+
+    // Deadline heap: earliest deadline first
+    printf("\n--- Deadline Heap ---\n");
+    Heap h = heapCreate(4);
+    long deadline;
+    heapPush(h, 10, time1, 300);
+    heapPush(h, 20, time2, 100);
+    heapPush(h, 30, time3, 200);
+    heapPush(h, 40, time4, 400);
+    heapPush(h, 50, time4, 50);  // full, ignored
+    printf("Heap size: %d\n", heapSize(h));
+    int descriptor = heapPop(h, NULL, &deadline);
+    printf("Popped earliest: %d (deadline %ld)\n", descriptor, deadline);
+    printf("Popped latest: %d\n", heapPopLatest(h, NULL));
+    heapPush(h, 60, time4, 150);
+    printf("Popped earliest: %d\n", heapPop(h, NULL, NULL));
+    printf("Popped earliest: %d\n", heapPop(h, NULL, NULL));
+    printf("Popped earliest: %d\n", heapPop(h, NULL, NULL));
+    printf("Popped from empty: %d\n", heapPop(h, NULL, NULL));
+    heapPrint(h);
+    heapDestroy(h);
+
+    printf("\n--- Random Eviction ---\n");
+    Queue r = queueCreate(8);
+    Heap rh = heapCreate(4);
+    int victims[8];
+    struct Eviction e;
+    for(int i = 1; i <= 7; i++)
+        enqueue(r, i, time1);
+    heapPush(rh, 100, time1, 300);
+    heapPush(rh, 200, time1, 100);
+    heapPush(rh, 300, time1, 200);
+    evictionStart(&e, queueSize(r) + heapSize(rh), victims);
+    int dropped = queueDropRandom(r, &e);
+    dropped += heapDropRandom(rh, &e);
+    printf("Evicted %d of 10, %d picked, %d left\n", dropped, e.count, queueSize(r) + heapSize(rh));
+    int in_order = 1, previous = 0, total = 0;
+    for(int i = 0; i < e.count; i++)
+        total += victims[i];
+    while(!queueEmpty(r)){
+        int d = dequeue(r);
+        in_order &= d > previous;
+        previous = d;
+        total += d;
+    }
+    long previous_deadline = 0;
+    while(!heapEmpty(rh)){
+        total += heapPop(rh, NULL, &deadline);
+        in_order &= deadline > previous_deadline;
+        previous_deadline = deadline;
+    }
+    printf("Survivors in order: %s, every request accounted for: %s\n", in_order ? "yes" : "no", total == 628 ? "yes" : "no");
+    evictionStart(&e, 0, victims);
+    printf("Evicted from empty: %d\n", queueDropRandom(r, &e));
+    queueDestroy(r);
+    heapDestroy(rh);
 }
 
 
@@ -8,7 +8,7 @@
 
 /*
     To run, compile the relavent files like so:
-    gcc -o test_queue tests.c queue.c -Wall
+    gcc -o test_queue tests.c queue.c segel.c -Wall
     execute:
     ./test_queue > output_queue.txt
     diff marrge: (If the files are identical, there will be no output)
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE /* splice, F_SETPIPE_SZ */
+#include "uring.h"
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+#define URING_ACCEPT 1       // user_data of the multishot accept
+#define URING_HEAD 1         // and of the three links of a response
+#define URING_PIPE_IN 2
+#define URING_PIPE_OUT 3
+#define URING_PIPE_SIZE (1 << 20)   // asked for, the kernel may give less (fs.pipe-max-size)
+
+struct Uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    unsigned tail;                  // submissions queued up to here, published by uringSubmit
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring;                     // the mappings, for uringFree
+    size_t ring_len, sqes_len;
+    int listenfd;                   // of the multishot accept, -1 if none
+};
+
+// the calling thread's ring and pipe for uringSendfile, set up on its first response
+static __thread Uring send_ring;
+static __thread int send_pipe[2];
+static __thread int send_pipe_size;
+static __thread int send_state;     // 0 not tried yet, 1 ready, -1 io_uring cannot be used
+
+Uring uringCreate(unsigned entries){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(fd < 0)
+        return NULL;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)){   // before 5.4, not worth a second mapping
+        close(fd);
+        errno = ENOSYS;
+        return NULL;
+    }
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_len = sq_len > cq_len ? sq_len : cq_len;
+    char *ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(ring == MAP_FAILED){
+        close(fd);
+        return NULL;
+    }
+    size_t sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED){
+        munmap(ring, ring_len);
+        close(fd);
+        return NULL;
+    }
+    Uring u = (Uring)malloc(sizeof(*u));
+    if(u == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    u->fd = fd;
+    u->entries = p.sq_entries;
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_array = (unsigned *)(ring + p.sq_off.array);
+    u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    u->sqes = (struct io_uring_sqe *)sqes;
+    u->ring = ring;
+    u->ring_len = ring_len;
+    u->sqes_len = sqes_len;
+    u->tail = *u->sq_tail;
+    u->listenfd = -1;
+    return u;
+}
+
+int uringFd(Uring u){
+    return u->fd;
+}
+
+// helper function
+static void uringFree(Uring u){
+    munmap(u->sqes, u->sqes_len);
+    munmap(u->ring, u->ring_len);
+    close(u->fd);
+    free(u);
+}
+
+// hand the queued submissions to the kernel and wait until wait completions are in,
+// the number submitted or -1
+// helper function
+static int uringSubmit(Uring u, unsigned wait){
+    unsigned submit = u->tail - *u->sq_tail;
+    int rc;
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    while((rc = syscall(__NR_io_uring_enter, u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0){
+        if(errno != EINTR)
+            return -1;
+    }
+    return rc;
+}
+
+// a cleared submission entry, queued once the caller has filled it in.
+// Without SQPOLL the kernel takes every entry during io_uring_enter, so a full
+// queue is emptied by submitting it
+// helper function
+static struct io_uring_sqe *uringSqe(Uring u){
+    if(u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->entries && uringSubmit(u, 0) < 0)
+        return NULL;
+    unsigned index = u->tail++ & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    return sqe;
+}
+
+// take the oldest completion into *cqe, 0 if there is none
+// helper function
+static int uringReap(Uring u, struct io_uring_cqe *cqe){
+    unsigned head = *u->cq_head;
+    if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    *cqe = u->cqes[head & u->cq_mask];
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int uringAcceptMultishot(Uring u, int listenfd){
+    struct io_uring_sqe *sqe = uringSqe(u);
+    if(sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT;
+    u->listenfd = listenfd;
+    return uringSubmit(u, 0) < 0 ? -1 : 0;
+}
+
+int uringAccepted(Uring u){
+    struct io_uring_cqe cqe;
+    if(!uringReap(u, &cqe)){
+        errno = EAGAIN;
+        return -1;
+    }
+    // the kernel drops a multishot request on errors and when the completion queue overflowed.
+    // out of descriptors it fails before looking at the backlog, re-armed it would fail again at once
+    if(!(cqe.flags & IORING_CQE_F_MORE) && cqe.res != -EINVAL && cqe.res != -EMFILE && cqe.res != -ENFILE)
+        uringAcceptMultishot(u, u->listenfd);
+    if(cqe.res < 0){
+        errno = -cqe.res;
+        return -1;
+    }
+    return cqe.res;
+}
+
+void uringFill(Uring u, rio_t **rios, int n){
+    struct io_uring_cqe cqe;
+    struct io_uring_sqe *sqe;
+    unsigned queued = 0;
+
+    for(int i = 0; i < n; i++){
+        rio_t *rp = rios[i];
+        if(rp->rio_bufptr != rp->rio_buf){   // as rio_fill: unread bytes to the front
+            memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        if(rp->rio_cnt == sizeof(rp->rio_buf) || (sqe = uringSqe(u)) == NULL)
+            continue;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = rp->rio_fd;
+        sqe->addr = (unsigned long)(rp->rio_buf + rp->rio_cnt);
+        sqe->len = sizeof(rp->rio_buf) - rp->rio_cnt;
+        sqe->msg_flags = MSG_DONTWAIT;   // completes inline, with EAGAIN if nothing is there
+        sqe->user_data = (unsigned long)rp;
+        queued++;
+    }
+    if(queued == 0 || uringSubmit(u, queued) < 0)
+        return;
+    while(queued > 0 && uringReap(u, &cqe)){
+        if(cqe.res > 0)
+            ((rio_t *)cqe.user_data)->rio_cnt += cqe.res;
+        queued--;
+    }
+}
+
+// helper function
+static int uringSendSetup(){
+    if(send_state != 0)
+        return send_state;
+    send_state = -1;
+    if((send_ring = uringCreate(4)) == NULL)
+        return -1;
+    if(pipe(send_pipe) < 0){
+        uringFree(send_ring);
+        send_ring = NULL;
+        return -1;
+    }
+    fcntl(send_pipe[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+    if((send_pipe_size = fcntl(send_pipe[1], F_GETPIPE_SZ)) <= 0){
+        close(send_pipe[0]);
+        close(send_pipe[1]);
+        uringFree(send_ring);
+        send_ring = NULL;
+        return -1;
+    }
+    return send_state = 1;
+}
+
+void uringSendRelease(){
+    if(send_state == 1){
+        uringFree(send_ring);
+        close(send_pipe[0]);
+        close(send_pipe[1]);
+    }
+    send_ring = NULL;
+    send_state = 0;
+}
+
+// move n bytes the pipe still holds into the socket
+// helper function
+static int uringDrainPipe(int out_fd, size_t n){
+    ssize_t moved;
+    while(n > 0){
+        if((moved = splice(send_pipe[0], NULL, out_fd, NULL, n, SPLICE_F_MOVE)) <= 0){
+            if(moved < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        n -= moved;
+    }
+    return 0;
+}
+
+// throw away what a failed send left in the pipe: the next send splices a whole
+// pipe's worth into it, and would wait forever for room
+// helper function
+static void uringEmptyPipe(){
+    char scrap[MAXBUF];
+    int left;
+    while(ioctl(send_pipe[0], FIONREAD, &left) == 0 && left > 0)
+        if(read(send_pipe[0], scrap, left < (int)sizeof(scrap) ? left : (int)sizeof(scrap)) <= 0)
+            break;
+}
+
+ssize_t uringSendfile(int out_fd, void *head, size_t head_len, int in_fd, size_t n){
+    struct io_uring_cqe cqe;
+    struct io_uring_sqe *sqe;
+    size_t offset = 0;
+    char *next = (char *)head;
+
+    if(uringSendSetup() < 0){
+        errno = ENOSYS;
+        return -1;
+    }
+    while(head_len > 0 || offset < n){
+        size_t chunk = n - offset < (size_t)send_pipe_size ? n - offset : (size_t)send_pipe_size;
+        unsigned queued = 0;
+        int head_res = 0, in_res = 0, out_res = 0;
+
+        // header -> file into the pipe -> pipe into the socket, each link starts when the one before it is done
+        if(head_len > 0){
+            sqe = uringSqe(send_ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = out_fd;
+            sqe->addr = (unsigned long)next;
+            sqe->len = head_len;
+            sqe->msg_flags = chunk ? MSG_MORE : 0;
+            sqe->flags = chunk ? IOSQE_IO_LINK : 0;
+            sqe->user_data = URING_HEAD;
+            queued++;
+        }
+        if(chunk > 0){
+            sqe = uringSqe(send_ring);
+            sqe->opcode = IORING_OP_SPLICE;
+            sqe->fd = send_pipe[1];
+            sqe->off = -1;
+            sqe->splice_fd_in = in_fd;
+            sqe->splice_off_in = offset;
+            sqe->len = chunk;
+            sqe->splice_flags = SPLICE_F_MOVE;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = URING_PIPE_IN;
+            sqe = uringSqe(send_ring);
+            sqe->opcode = IORING_OP_SPLICE;
+            sqe->fd = out_fd;
+            sqe->off = -1;
+            sqe->splice_fd_in = send_pipe[0];
+            sqe->splice_off_in = -1;
+            sqe->len = chunk;
+            sqe->splice_flags = SPLICE_F_MOVE | (offset + chunk < n ? SPLICE_F_MORE : 0);
+            sqe->user_data = URING_PIPE_OUT;
+            queued += 2;
+        }
+        if(uringSubmit(send_ring, queued) < 0){
+            if(next == head && offset == 0)
+                errno = ENOSYS;
+            return -1;
+        }
+        while(queued > 0 && uringReap(send_ring, &cqe)){
+            if(cqe.user_data == URING_HEAD)
+                head_res = cqe.res;
+            else if(cqe.user_data == URING_PIPE_IN)
+                in_res = cqe.res;
+            else
+                out_res = cqe.res;
+            queued--;
+        }
+
+        // a short or failed link cancels the ones after it (ECANCELED)
+        if(head_res < 0){
+            errno = (next == head && (head_res == -EINVAL || head_res == -EOPNOTSUPP)) ? ENOSYS : -head_res;
+            return -1;
+        }
+        if((size_t)head_res < head_len){
+            next += head_res;
+            head_len -= head_res;
+            continue;
+        }
+        head_len = 0;
+        if(chunk == 0)
+            break;
+        if(in_res < 0){
+            if(in_res == -EINVAL && offset == 0)   // no splice for this file: as sendfile would
+                return rio_sendfile(out_fd, in_fd, 0, n);
+            errno = -in_res;
+            return -1;
+        }
+        if(in_res == 0){   // file shrank under us
+            errno = EIO;
+            return -1;
+        }
+        if(out_res < 0 && out_res != -ECANCELED){
+            uringEmptyPipe();
+            errno = -out_res;
+            return -1;
+        }
+        if(out_res < in_res && uringDrainPipe(out_fd, in_res - (out_res > 0 ? out_res : 0)) < 0){
+            int err = errno;
+            uringEmptyPipe();
+            errno = err;
+            return -1;
+        }
+        offset += in_res;
+    }
+    return n;
+}
+
+#else
+
+// built without USE_IO_URING: nothing can be set up, every caller takes its plain path
+Uring uringCreate(unsigned entries){
+    errno = ENOSYS;
+    return NULL;
+}
+
+int uringFd(Uring u){
+    return -1;
+}
+
+int uringAcceptMultishot(Uring u, int listenfd){
+    errno = ENOSYS;
+    return -1;
+}
+
+int uringAccepted(Uring u){
+    errno = ENOSYS;
+    return -1;
+}
+
+void uringFill(Uring u, rio_t **rios, int n){
+}
+
+ssize_t uringSendfile(int out_fd, void *head, size_t head_len, int in_fd, size_t n){
+    errno = ENOSYS;
+    return -1;
+}
+
+void uringSendRelease(){
+}
+
+#endif
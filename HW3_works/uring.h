@@ -0,0 +1,56 @@
+#ifndef URING_H
+#define URING_H
+
+#include "segel.h"
+
+//
+// uring.c: an io_uring I/O engine for the socket work of the server, built
+// only with "make IO_URING=1" (USE_IO_URING). It talks to the kernel with the
+// raw syscalls from <linux/io_uring.h>, liburing is not needed.
+//
+//  - accept: one multishot accept per listening socket. The ring's descriptor
+//    sits in the acceptor's epoll instead of the socket, and the new
+//    connections are read off the completion queue without a syscall.
+//  - recv: the client sockets epoll reports in one round are all filled into
+//    their rio buffers by a single submission, instead of a recv each.
+//  - send: a static response is a linked chain: the header (MSG_MORE), then
+//    the file spliced into a pipe and from the pipe into the socket, one
+//    io_uring_enter for header and body.
+//
+// Without USE_IO_URING, or on a kernel that refuses io_uring, uringCreate
+// returns NULL and uringSendfile fails with ENOSYS without sending anything,
+// and the callers keep to epoll, recv, send and sendfile.
+//
+// A ring belongs to one thread.
+//
+
+typedef struct Uring *Uring;
+
+// a ring with room for entries submissions at once, NULL if io_uring cannot be used
+Uring uringCreate(unsigned entries);
+
+// the descriptor that polls readable while completions are waiting
+int uringFd(Uring u);
+
+// arm a multishot accept on listenfd, 0 on success
+int uringAcceptMultishot(Uring u, int listenfd);
+
+// the next accepted descriptor, -1 with errno EAGAIN once none is left.
+// EINVAL: this kernel has no multishot accept, go back to accept()
+// EMFILE, ENFILE: out of descriptors, the accept is off until uringAcceptMultishot is called again
+int uringAccepted(Uring u);
+
+// add what each socket already holds to its rio buffer, never blocks.
+// EOF and errors are not reported, the next read on that rio_t sees them
+void uringFill(Uring u, rio_t **rios, int n);
+
+// send the header then n bytes of in_fd from its start, like rio_sendn followed
+// by rio_sendfile. Returns n, or -1 with errno set. ENOSYS: io_uring cannot be
+// used and nothing was sent. EINVAL: the header was sent but the file cannot be
+// spliced, and none of it was sent.
+ssize_t uringSendfile(int out_fd, void *head, size_t head_len, int in_fd, size_t n);
+
+// free the calling thread's ring and pipe of uringSendfile, before it exits
+void uringSendRelease();
+
+#endif // URING_H